@@ -1,6 +1,7 @@
 #include <iostream>
 #include <cstdio>
 #include <stdio.h>
+#include <random>
 
 #include <sys/stat.h>
 
@@ -14,11 +15,500 @@
 
 using namespace std;
 
+// Limits on the BAKEVERSOR lattice: samples per axis, and memory
+static const int maxVersorBakeRes = 512;
+static const double maxVersorBakeMB = 2048;
+
+// Drops n arguments after argv[0], as the directives are consumed
+static void shiftArgs(int& argc, char *argv[], int n) {
+    for (int i = 1; i + n < argc; ++i) {
+        argv[i] = argv[i + n];
+    }
+    argc -= n;
+}
+
+// Times each Julia engine on the same random points in the bounds box, checking
+// every engine against the scalar path
+static void benchJuliaEngines(R3JuliaSet& julia, const AABB& box, int numPoints) {
+    const size_t batchSize = 256; // on the order of one march_cubes row
+
+    mt19937 rng(1234);
+    uniform_real_distribution<Real> unit(0, 1);
+    vector<VEC3F> points(numPoints);
+    for (VEC3F& p : points) {
+        p = box.min() + VEC3F(unit(rng), unit(rng), unit(rng)).cwiseProduct(box.span());
+    }
+
+    vector<Real> reference(numPoints), values(numPoints);
+    const R3JuliaSet::ENGINE defaultEngine = julia.engine;
+    const R3JuliaSet::ENGINE engines[] = { R3JuliaSet::SCALAR, R3JuliaSet::BATCH };
+
+    printf("Julia engines on %d points (batches of %zu, one thread), default is %s:\n", numPoints, batchSize, R3JuliaSet::engineName(defaultEngine));
+
+    R3JuliaSet::ENGINE fastest = defaultEngine;
+    double fastestRate = 0;
+
+    TIMER_INIT();
+    for (R3JuliaSet::ENGINE e : engines) {
+        julia.engine = e;
+        vector<Real>& out = (e == R3JuliaSet::SCALAR) ? reference : values;
+
+        TIMER_START();
+        for (size_t i = 0; i < points.size(); i += batchSize) {
+            julia.getFieldValues(&points[i], &out[i], min(batchSize, points.size() - i));
+        }
+        TIMER_END();
+
+        Real maxDiff = 0;
+        for (size_t i = 0; i < points.size(); ++i) {
+            maxDiff = max(maxDiff, fabs(out[i] - reference[i]));
+        }
+
+        const double rate = numPoints / TIMER_DURATION;
+        if (rate > fastestRate) {
+            fastest = e;
+            fastestRate = rate;
+        }
+        printf("    %-20s  %12.0f points/sec   max |diff| vs scalar: %.3e\n", R3JuliaSet::engineName(e), rate, maxDiff);
+    }
+    printf("Fastest engine: %s, %.0f points/sec\n", R3JuliaSet::engineName(fastest), fastestRate);
+
+    julia.engine = defaultEngine;
+}
+
+// Times baked versor lookups against the analytic noise at random points in the bake box, for
+// the chosen lattice and 2x, 4x and 8x coarser ones, and works out the lattice size above which
+// baking costs more than it saves over about expectedLookups versor lookups
+static void benchVersorBake(const NoiseVersor& versor, const BakedVersor& baked, Real spacing, int numPoints, double expectedLookups) {
+    const size_t batchSize = 256;
+    const int threads = omp_get_max_threads();
+
+    mt19937 rng(1234);
+    uniform_real_distribution<Real> unit(0, 1);
+    vector<VEC3F> points(numPoints), out(numPoints);
+    for (VEC3F& p : points) {
+        p = baked.box.min() + VEC3F(unit(rng), unit(rng), unit(rng)).cwiseProduct(baked.box.span());
+    }
+
+    TIMER_INIT();
+    auto time = [&](const R3Map& m) {
+        TIMER_START();
+        for (size_t i = 0; i < points.size(); i += batchSize) {
+            m.getFieldValues(&points[i], &out[i], min(batchSize, points.size() - i));
+        }
+        TIMER_END();
+        return TIMER_DURATION / numPoints;
+    };
+
+    printf("Versor lookups on %d points in the bake box (batches of %zu, one thread):\n", numPoints, batchSize);
+    const double analytic = time(versor);
+    printf("    %-22s %12.0f lookups/sec\n", "analytic", 1 / analytic);
+
+    // Bake time is spread over all threads, and so are the lookups while marching
+    auto report = [&](const BakedVersor& b) {
+        const double lookup = time(b);
+        Real noiseError, versorError, rmsVersorError;
+        b.measureError(numPoints, noiseError, versorError, rmsVersorError);
+
+        char name[64], payoff[64];
+        snprintf(name, sizeof(name), "%dx%dx%d", b.grid->xRes, b.grid->yRes, b.grid->zRes);
+        if (lookup < analytic) snprintf(payoff, sizeof(payoff), "%.3g lookups", b.bakeSeconds * threads / (analytic - lookup));
+        else snprintf(payoff, sizeof(payoff), "never");
+        printf("    %-22s %12.0f lookups/sec  %7.1f MB  bake %.2fs  channel err %.2e  versor err %.2e (rms %.2e)  pays off after %s\n",
+            name, 1 / lookup, b.memoryBytes() / pow(2.0, 20.0), b.bakeSeconds, noiseError, versorError, rmsVersorError, payoff);
+        return lookup;
+    };
+
+    for (int coarsen = 8; coarsen > 1; coarsen /= 2) {
+        BakedVersor coarse(&versor, baked.box, spacing * coarsen);
+        report(coarse);
+    }
+    const double lookup = report(baked);
+
+    // Baking n^3 samples pays off while n^3 * (bake time per sample) < expectedLookups * (time saved per lookup)
+    if (lookup < analytic) {
+        const double perSample = baked.bakeSeconds * threads / baked.grid->totalCells();
+        const double breakEven = cbrt(expectedLookups * (analytic - lookup) / perSample);
+        printf("    About %.3g versor lookups expected: baking pays off up to about %.0f^3 samples (chosen: %dx%dx%d)\n",
+            expectedLookups, breakEven, baked.grid->xRes, baked.grid->yRes, baked.grid->zRes);
+    } else {
+        printf("    Baked lookups are no faster than the analytic noise here, so baking doesn't pay off\n");
+    }
+}
+
+// Coarse pre-pass for the tile scheduler: Julia values and iteration counts on a cr^3
+// sub-lattice of the marching lattice, cr points per axis spaced res/cr lattice cells apart
+struct CoarseCostSamples {
+    int cr;
+    Real stride;
+    vector<Real> values;
+    vector<int> iterations;
+
+    CoarseCostSamples(const R3JuliaSet& julia, const VirtualGrid3D& vg, int cr): cr(cr), stride(Real(vg.xRes) / cr) {
+        values.resize(size_t(cr) * cr * cr);
+        iterations.resize(values.size());
+
+        #pragma omp parallel for schedule(dynamic)
+        for (int z = 0; z < cr; z++) {
+            for (int y = 0; y < cr; y++) {
+                for (int x = 0; x < cr; x++) {
+                    const size_t i = index(x, y, z);
+                    values[i] = julia.getFieldValueAndIterations(vg.gridToFieldCoords(VEC3F(x, y, z) * stride), iterations[i]);
+                }
+            }
+        }
+    }
+
+    size_t index(int x, int y, int z) const { return (size_t(z) * cr + y) * cr + x; }
+
+    // Mean root-finder evaluations per vertex, measured on up to maxEdges lattice edges of the
+    // marched grid, found where the surface crosses an x edge of the coarse lattice. Returns 0
+    // if no crossed edge turns up.
+    double measureEvalsPerEdge(Grid3D* grid, int maxEdges) const {
+        size_t evaluations = 0;
+        int edges = 0;
+        for (int z = 0; z < cr && edges < maxEdges; z++) {
+            for (int y = 0; y < cr && edges < maxEdges; y++) {
+                for (int x = 0; x + 1 < cr && edges < maxEdges; x++) {
+                    if ((values[index(x, y, z)] < 0) == (values[index(x + 1, y, z)] < 0)) continue;
+
+                    const int fy = min<int>(grid->yRes - 1, lround(y * stride));
+                    const int fz = min<int>(grid->zRes - 1, lround(z * stride));
+                    const int end = min<int>(grid->xRes - 1, lround((x + 1) * stride));
+                    Real previous = grid->getf(VEC3F(lround(x * stride), fy, fz));
+                    for (int fx = lround(x * stride); fx < end; fx++) {
+                        const Real next = grid->getf(VEC3F(fx + 1, fy, fz));
+                        if ((previous < 0) != (next < 0)) {
+                            evaluations += MC::rootFindingEvaluationsOnEdge(grid, fx, fy, fz, 0);
+                            edges++;
+                            break;
+                        }
+                        previous = next;
+                    }
+                }
+            }
+        }
+        return edges ? double(evaluations) / edges : 0;
+    }
+
+    // Predicted cost of marching a lattice window, in Julia map applications: one field
+    // evaluation per lattice point at the window's mean iteration count, plus evalsPerEdge
+    // evaluations per surface vertex at the full iteration count (points near the surface
+    // rarely escape early). Each coarse cell the surface crosses holds about stride^2 surface
+    // cells of the fine lattice, with about one vertex each.
+    double predict(const VEC3I& wMin, const VEC3I& wMax, int maxIterations, double evalsPerEdge) const {
+        VEC3I lo, hi;
+        for (int a = 0; a < 3; a++) {
+            lo[a] = max(0, int(ceil(wMin[a] / stride)));
+            hi[a] = min(cr - 1, int(floor(wMax[a] / stride)));
+        }
+
+        double iterationSum = 0;
+        size_t samples = 0, surfaceCells = 0;
+        for (int z = lo.z(); z <= hi.z(); z++) {
+            for (int y = lo.y(); y <= hi.y(); y++) {
+                for (int x = lo.x(); x <= hi.x(); x++) {
+                    iterationSum += iterations[index(x, y, z)];
+                    samples++;
+
+                    if (x == hi.x() || y == hi.y() || z == hi.z()) continue;
+                    int inside = 0;
+                    for (int c = 0; c < 8; c++)
+                        inside += values[index(x + (c & 1), y + ((c >> 1) & 1), z + (c >> 2))] < 0;
+                    surfaceCells += (inside > 0 && inside < 8);
+                }
+            }
+        }
+
+        // Windows between coarse points get the average of the whole pass
+        double meanIterations = 0;
+        if (samples) meanIterations = iterationSum / samples;
+        else {
+            for (int it : iterations) meanIterations += it;
+            meanIterations /= iterations.size();
+        }
+
+        const VEC3I cells = wMax - wMin + VEC3I(1, 1, 1);
+        const double latticePoints = double(cells.x()) * cells.y() * cells.z();
+        return latticePoints * meanIterations + surfaceCells * stride * stride * evalsPerEdge * maxIterations;
+    }
+};
+
+// Splits lattice windows predicted to cost more than splitFactor times the mean into their 8
+// octants (sharing the middle planes), for up to maxRounds rounds. Children take their
+// parent's place, so the tile order stays spatial.
+static void splitHotTiles(const CoarseCostSamples& coarse, vector<VEC3I>& windowMin, vector<VEC3I>& windowMax, vector<double>& cost,
+                          int maxIterations, double evalsPerEdge, double splitFactor = 2, int maxRounds = 2) {
+    for (int round = 0; round < maxRounds; round++) {
+        double mean = 0;
+        for (double c : cost) mean += c;
+        mean /= cost.size();
+
+        vector<VEC3I> newMin, newMax;
+        vector<double> newCost;
+        int split = 0;
+        for (size_t t = 0; t < cost.size(); t++) {
+            const VEC3I lo = windowMin[t], hi = windowMax[t];
+            if (cost[t] <= splitFactor * mean || (hi - lo).minCoeff() < 2) {
+                newMin.push_back(lo);
+                newMax.push_back(hi);
+                newCost.push_back(cost[t]);
+                continue;
+            }
+
+            const VEC3I mid = (lo + hi) / 2;
+            for (int c = 0; c < 8; c++) {
+                VEC3I cMin, cMax;
+                for (int a = 0; a < 3; a++) {
+                    const bool upper = (c >> a) & 1;
+                    cMin[a] = upper ? mid[a] : lo[a];
+                    cMax[a] = upper ? hi[a] : mid[a];
+                }
+                newMin.push_back(cMin);
+                newMax.push_back(cMax);
+                newCost.push_back(coarse.predict(cMin, cMax, maxIterations, evalsPerEdge));
+            }
+            split++;
+        }
+
+        PRINTF("Split %d hot tiles (over %.1fx the mean predicted cost), %zu tiles now\n", split, splitFactor, newCost.size());
+        windowMin.swap(newMin);
+        windowMax.swap(newMax);
+        cost.swap(newCost);
+        if (!split) break;
+    }
+}
+
+// Marches the grid straight into the output file, binary PLY for *.ply and OBJ otherwise
+static void streamMesh(Grid3D* grid, const string& filename) {
+    MeshSink* sink;
+    if (Mesh::isPLYFilename(filename)) sink = new PLYWriter(filename);
+    else sink = new OBJWriter(filename);
+
+    MC::march_cubes_stream(grid, *sink, true, true);
+    sink->close();
+    PRINTF("Wrote %zu vertices and %zu faces to %s\n", sink->numVertices, sink->numTriangles, filename.c_str());
+    delete sink;
+}
+
+// Times interpolated SDF lookups at random points in the SDF bounds (the access pattern of
+// a chaotic orbit) with each ArrayGrid3D layout and storage precision, checking each against
+// the SDF as loaded. Doubles in every layout take InterpolationGrid's fused path, once more in
+// batches. INT16 is quantized over [-band, band] (0: the whole value range), and its
+// error is measured inside the band only, as is that of a SparseGrid3D over [sparseMin, sparseMax]
+// (skipped if the range is empty).
+static void benchSDFStorage(const Grid3D& sdf, int numPoints, Real band, Real sparseMin, Real sparseMax) {
+    ArrayGrid3D grid(sdf.xRes, sdf.yRes, sdf.zRes);
+    for (uint z = 0; z < sdf.zRes; z++) {
+        for (uint y = 0; y < sdf.yRes; y++) {
+            sdf.getRow(y, z, &grid.at(0, y, z));
+        }
+    }
+    grid.setMapBox(sdf.mapBox);
+
+    mt19937 rng(1234);
+    uniform_real_distribution<Real> unit(0, 1);
+    vector<VEC3F> points(numPoints);
+    for (VEC3F& p : points) {
+        p = sdf.mapBox.min() + VEC3F(unit(rng), unit(rng), unit(rng)).cwiseProduct(sdf.mapBox.span());
+    }
+
+    vector<Real> reference(numPoints), values(numPoints);
+    const ArrayGrid3D::LAYOUT layouts[] = { ArrayGrid3D::LINEAR, ArrayGrid3D::BRICK4, ArrayGrid3D::BRICK8, ArrayGrid3D::MORTON };
+    const ArrayGrid3D::PRECISION precisions[] = { ArrayGrid3D::FLOAT, ArrayGrid3D::INT16 };
+
+    printf("SDF storage, %d trilinear lookups on the %dx%dx%d SDF (one thread):\n", numPoints, grid.xRes, grid.yRes, grid.zRes);
+
+    TIMER_INIT();
+    auto run = [&](const char* name, Grid3D& base, size_t bytes, vector<Real>& out, Real refMin, Real refMax, bool batched = false) {
+        InterpolationGrid interpolated(&base, InterpolationGrid::LINEAR);
+
+        TIMER_START();
+        if (batched) {
+            for (size_t i = 0; i < points.size(); i += 256) {
+                interpolated.getFieldValues(&points[i], &out[i], min<size_t>(256, points.size() - i));
+            }
+        } else {
+            for (size_t i = 0; i < points.size(); ++i) {
+                out[i] = interpolated.getFieldValue(points[i]);
+            }
+        }
+        TIMER_END();
+
+        Real maxDiff = 0;
+        for (size_t i = 0; i < points.size(); ++i) {
+            if (reference[i] >= refMin && reference[i] <= refMax) maxDiff = max(maxDiff, fabs(out[i] - reference[i]));
+        }
+
+        printf("    %-22s %7.1f MB  %12.0f lookups/sec   max |diff| vs double: %.3e\n", name,
+            bytes / pow(2.0, 20.0), numPoints / TIMER_DURATION, maxDiff);
+    };
+    const Real all = numeric_limits<Real>::max();
+
+    for (ArrayGrid3D::LAYOUT l : layouts) {
+        grid.setLayout(l);
+        char name[64];
+        snprintf(name, sizeof(name), "%s, batched", ArrayGrid3D::layoutName(l));
+        run(ArrayGrid3D::layoutName(l), grid, grid.storageBytes(), (l == ArrayGrid3D::LINEAR) ? reference : values, -all, all);
+        run(name, grid, grid.storageBytes(), values, -all, all, true);
+    }
+
+    grid.setLayout(ArrayGrid3D::LINEAR);
+
+    if (sparseMin < sparseMax) {
+        SparseGrid3D sparse(grid, sparseMin, sparseMax);
+        char name[64];
+        snprintf(name, sizeof(name), "sparse [%g, %g]", sparseMin, sparseMax);
+        run(name, sparse, sparse.memoryBytes(), values, sparseMin, sparseMax);
+    }
+
+    for (ArrayGrid3D::PRECISION p : precisions) {
+        grid.setPrecision(p, band);
+        char name[64];
+        if (p == ArrayGrid3D::INT16) snprintf(name, sizeof(name), "int16 (band %g)", grid.getQuantizationBand());
+        else snprintf(name, sizeof(name), "%s", ArrayGrid3D::precisionName(p));
+        const Real maxRef = (p == ArrayGrid3D::INT16) ? grid.getQuantizationBand() : all;
+        run(name, grid, grid.storageBytes(), values, -maxRef, maxRef);
+        grid.setPrecision(ArrayGrid3D::DOUBLE);
+    }
+}
+
 int main(int argc, char *argv[]) {
+    int benchPoints = 0;
+    int cullBlockSize = 0;
+    int sparseBrickSize = 0;
+    int tilesPerAxis = 0;
+    int balanceRes = 0;
+    bool stream = false;
+    bool mapSDF = false;
+    bool convertSDF = false;
+    ArrayGrid3D::LAYOUT sdfLayout = ArrayGrid3D::LINEAR;
+    ArrayGrid3D::PRECISION sdfPrecision = ArrayGrid3D::DOUBLE;
+    Real sdfBand = 0;
+    Real narrowMin = 0, narrowMax = 0;
+    Real versorBakeError = 0;
+    int maskGridRes = 0;
+
+    // Optional directives come before the positional parameters
+    while (argc > 1) {
+        string directive(argv[1]);
+        if (directive == "THREADS" && argc > 2) {
+            MC::setNumThreads(atoi(argv[2]));
+            shiftArgs(argc, argv, 2);
+        } else if (directive == "BENCH" && argc > 2) {
+            benchPoints = atoi(argv[2]);
+            shiftArgs(argc, argv, 2);
+        } else if (directive == "CULL" && argc > 2) {
+            cullBlockSize = atoi(argv[2]);
+            shiftArgs(argc, argv, 2);
+        } else if (directive == "ROOTFIND" && argc > 4) {
+            string method(argv[2]);
+            transform(method.begin(), method.end(), method.begin(), ::tolower);
+            MC::ROOT_FINDER finder;
+            if (method == "bisection") finder = MC::BISECTION;
+            else if (method == "linear") finder = MC::LINEAR;
+            else if (method == "illinois") finder = MC::ILLINOIS;
+            else if (method == "brent") finder = MC::BRENT;
+            else {
+                PRINTF("Unknown root finder '%s'. Valid choices are bisection, linear, illinois and brent.\n", argv[2]);
+                exit(1);
+            }
+            MC::setRootFinder(finder, atoi(argv[3]), atof(argv[4]));
+            shiftArgs(argc, argv, 4);
+        } else if (directive == "TILES" && argc > 2) {
+            tilesPerAxis = atoi(argv[2]);
+            if (tilesPerAxis < 1 || (tilesPerAxis & (tilesPerAxis - 1))) {
+                PRINTF("TILES needs a power of two, got %s\n", argv[2]);
+                exit(1);
+            }
+            shiftArgs(argc, argv, 2);
+        } else if (directive == "BALANCE" && argc > 2) {
+            balanceRes = atoi(argv[2]);
+            shiftArgs(argc, argv, 2);
+        } else if (directive == "MMAP") {
+            mapSDF = true;
+            shiftArgs(argc, argv, 1);
+        } else if (directive == "LAYOUT" && argc > 2) {
+            string name(argv[2]);
+            transform(name.begin(), name.end(), name.begin(), ::tolower);
+            if (name == "linear") sdfLayout = ArrayGrid3D::LINEAR;
+            else if (name == "brick4") sdfLayout = ArrayGrid3D::BRICK4;
+            else if (name == "brick8") sdfLayout = ArrayGrid3D::BRICK8;
+            else if (name == "morton") sdfLayout = ArrayGrid3D::MORTON;
+            else {
+                PRINTF("Unknown SDF layout '%s'. Valid choices are linear, brick4, brick8 and morton.\n", argv[2]);
+                exit(1);
+            }
+            convertSDF = true;
+            shiftArgs(argc, argv, 2);
+        } else if (directive == "PRECISION" && argc > 2) {
+            string name(argv[2]);
+            transform(name.begin(), name.end(), name.begin(), ::tolower);
+            int consumed = 2;
+            if (name == "double") sdfPrecision = ArrayGrid3D::DOUBLE;
+            else if (name == "float") sdfPrecision = ArrayGrid3D::FLOAT;
+            else if (name == "int16" && argc > 3) {
+                sdfPrecision = ArrayGrid3D::INT16;
+                sdfBand = atof(argv[3]);
+                consumed = 3;
+            } else {
+                PRINTF("Unknown SDF precision '%s'. Valid choices are double, float and int16 <band>.\n", argv[2]);
+                exit(1);
+            }
+            convertSDF = true;
+            shiftArgs(argc, argv, consumed);
+        } else if (directive == "NARROWBAND" && argc > 3) {
+            narrowMin = atof(argv[2]);
+            narrowMax = atof(argv[3]);
+            if (narrowMin >= narrowMax) {
+                PRINTF("NARROWBAND needs min < max, got %s %s\n", argv[2], argv[3]);
+                exit(1);
+            }
+            shiftArgs(argc, argv, 3);
+        } else if (directive == "STREAM") {
+            stream = true;
+            shiftArgs(argc, argv, 1);
+        } else if (directive == "BAKEVERSOR" && argc > 2) {
+            versorBakeError = atof(argv[2]);
+            if (versorBakeError <= 0) {
+                PRINTF("BAKEVERSOR needs a positive error target, got %s\n", argv[2]);
+                exit(1);
+            }
+            shiftArgs(argc, argv, 2);
+        } else if (directive == "MASKGRID" && argc > 2) {
+            maskGridRes = atoi(argv[2]);
+            if (maskGridRes < 2) {
+                PRINTF("MASKGRID needs at least 2 samples per axis, got %s\n", argv[2]);
+                exit(1);
+            }
+            shiftArgs(argc, argv, 2);
+        } else if (directive == "SPARSE" && argc > 2) {
+            sparseBrickSize = atoi(argv[2]);
+            shiftArgs(argc, argv, 2);
+        } else {
+            break;
+        }
+    }
+
+    if (stream && (tilesPerAxis > 1 || sparseBrickSize > 0)) {
+        PRINT("STREAM can't be combined with TILES or SPARSE");
+        exit(1);
+    }
+
+    if (sparseBrickSize > 0 && cullBlockSize <= 0) {
+        PRINT("SPARSE needs CULL, which bounds the field's sign over the bricks it skips");
+        exit(1);
+    }
+
+    if (narrowMin < narrowMax && (convertSDF || mapSDF)) {
+        PRINT("NARROWBAND can't be combined with MMAP, LAYOUT or PRECISION");
+        exit(1);
+    }
+
     if(argc != 12 && argc != 13) {
         cout << "USAGE: " << endl;
         cout << "To create a self-similar Julia set from a distance field and portal description file:" << endl;
-        cout << " " << argv[0] << " <SDF *.f3d> <portals *.txt> <versor octaves> <versor scale> <output resolution> <alpha> <beta> <offset x> <offset y> <offset z> <output *.obj> <optional: octree specifier string>" << endl << endl;
+        cout << " " << argv[0] << " [directives] <SDF *.f3d> <portals *.txt> <versor octaves> <versor scale> <output resolution> <alpha> <beta> <offset x> <offset y> <offset z> <output *.obj> <optional: octree specifier string>" << endl << endl;
         //                            argv[1]        argv[2]        argv[3]          argv[4]        argv[5]        argv[6] argv[7]  argv[8]    argv[9]   argv[10]      argv[11]               argv[12]
 
         cout << "    This will generate a shape modulus Julia set using the SDF that you provide and Perlin noise for the versor field." << endl;
@@ -48,22 +538,67 @@ int main(int argc, char *argv[]) {
         cout << "        Z ●           " << endl;
         cout << "        (into page)   " << endl;
 
-        cout << "    Each character of the string will go one level deeper, so the string '5555' specifies the 1/16-edge length box at the far back corner." << endl;
+        cout << "    Each character of the string will go one level deeper, so the string '5555' specifies the 1/16-edge length box at the far back corner." << endl << endl;
+
+        cout << "    Directives may be given before the other parameters, e.g. '" << argv[0] << " THREADS 8 <SDF *.f3d> ...':" << endl;
+        cout << "        THREADS <n>   march with n threads (default: all available cores)" << endl;
+        cout << "        BENCH <n>     time the evaluation paths on n random points in the bounds and exit without marching" << endl;
+        cout << "        CULL <n>      skip the Julia iteration in n^3 lattice blocks that the SDF alone shows are far from the shell" << endl;
+        cout << "        ROOTFIND <method> <max evals> <tol>" << endl;
+        cout << "                      place edge vertices with bisection (default: 100 evals, tol 0), linear, illinois or brent," << endl;
+        cout << "                      with at most max evals field evaluations per edge, stopping at a tol-wide bracket (grid units)" << endl;
+        cout << "        TILES <n>     split the bounds into n x n x n octree tiles (n a power of two), march them as parallel" << endl;
+        cout << "                      tasks and weld them into one mesh; replaces prun + mesh_cat on a single machine" << endl;
+        cout << "        BALANCE <n>   with TILES, predict each tile's cost from an n^3 coarse pass, split hot tiles and" << endl;
+        cout << "                      march the most expensive first, logging predicted vs actual tile times" << endl;
+        cout << "        SPARSE <n>    only march n^3-cell bricks the surface passes through, found from a coarse lattice" << endl;
+        cout << "                      with the sign bounds of CULL, which it requires" << endl;
+        cout << "        MMAP          map the SDF file read-only instead of reading it, so its pages load on demand and" << endl;
+        cout << "                      are shared between processes using the same file" << endl;
+        cout << "        LAYOUT <l>    store the SDF in memory as linear (default), brick4, brick8 or morton (Z-order 8^3 bricks)" << endl;
+        cout << "        PRECISION <p> store the SDF in memory as double (default), float, or 'int16 <band>': 16-bit" << endl;
+        cout << "                      steps over [-band, band] with values beyond it clamped (band 0: the whole range)" << endl;
+        cout << "                      With LAYOUT or PRECISION, an F3D v2 SDF is decoded whole and a mapped one copied" << endl;
+        cout << "        NARROWBAND <min> <max>" << endl;
+        cout << "                      keep exact SDF values only in the 8^3 leaves with values in [min, max], and their" << endl;
+        cout << "                      mean elsewhere. The band should cover the SDF values along the output surface." << endl;
+        cout << "                      The SDF file is read a slab at a time, so it can be larger than memory" << endl;
+        cout << "        STREAM        write the mesh slab by slab as it is marched instead of holding all of it in memory" << endl;
+        cout << "        MASKGRID <n>  bake the portal mask's sign into an n^3 bit grid over each portal sphere at startup," << endl;
+        cout << "                      so points in a portal read a bit instead of iterating the mask Julia set" << endl;
+        cout << "        BAKEVERSOR <e> sample the versor noise on a lattice fine enough for trilinear lookups to stay within e" << endl;
+        cout << "                      of it, over the bounds and the unit cube around the origin where most orbits stay;" << endl;
+        cout << "                      the analytic noise is used outside. Reports the error and the break-even lattice size" << endl;
+        cout << "                      (at most 512 samples per axis, with a warning of the looser bound, and 2 GB)" << endl;
+        cout << "    The output is written as binary PLY if its name ends in .ply, OBJ otherwise." << endl;
 
         exit(0);
     }
 
     // Read distfield
-    ArrayGrid3D distFieldCoarse(argv[1]);
-    PRINTF("Got distance field with res %dx%dx%d\n", distFieldCoarse.xRes, distFieldCoarse.yRes, distFieldCoarse.zRes);
+    // F3D v2 files are decoded brick by brick as the field is sampled, unless a layout is given
+    Grid3D* distFieldCoarse;
+    if (narrowMin < narrowMax) {
+        distFieldCoarse = new SparseGrid3D(argv[1], narrowMin, narrowMax, true);
+    } else if (F3D2File::isF3D2(argv[1]) && !convertSDF) {
+        distFieldCoarse = new F3DBrickGrid(argv[1]);
+    } else {
+        ArrayGrid3D* array = new ArrayGrid3D(argv[1], "f3d", false, mapSDF);
+        if (convertSDF) {
+            array->setLayout(sdfLayout);
+            array->setPrecision(sdfPrecision, sdfBand);
+            PRINTF("SDF stored as %s %s, %.1f MB\n", ArrayGrid3D::layoutName(sdfLayout), ArrayGrid3D::precisionName(sdfPrecision),
+                array->storageBytes() / pow(2.0, 20.0));
+        }
+        distFieldCoarse = array;
+    }
+    PRINTF("Got distance field with res %dx%dx%d\n", distFieldCoarse->xRes, distFieldCoarse->yRes, distFieldCoarse->zRes);
 
     // Create interpolation grid (smooth it out)
-    InterpolationGrid distField(&distFieldCoarse, InterpolationGrid::LINEAR);
-    distField.mapBox.setCenter(VEC3F(0,0,0));
+    InterpolationGrid distField(distFieldCoarse, InterpolationGrid::LINEAR);
 
     PRINT("NOTE: Setting simulation bounds to hard-coded values (not from distance field)");
-    distField.mapBox.min() = VEC3F(-0.5, -0.5, -0.5);
-    distField.mapBox.max() = VEC3F(0.5, 0.5, 0.5);
+    AABB distBox(VEC3F(-0.5, -0.5, -0.5), VEC3F(0.5, 0.5, 0.5));
 
     // Now we actually compute the Julia set
     Real alpha = atof(argv[6]);
@@ -73,7 +608,8 @@ int main(int argc, char *argv[]) {
     // effect - this is optional, and for all our results in the paper was zero.
     VEC3F offset3D(atof(argv[8]), atof(argv[9]), atof(argv[10]));
 
-    distField.mapBox.setCenter(offset3D);
+    distBox.setCenter(offset3D);
+    distField.setMapBox(distBox);
 
     int res = atoi(argv[5]);
 
@@ -108,17 +644,48 @@ int main(int argc, char *argv[]) {
     NoiseVersor  versor(versor_octaves, versor_scale);
     ShapeModulus modulus(&distField, alpha, beta);
 
-    VersorModulusR3Map vm(&versor, &modulus);
-    R3JuliaSet         mask_j(&vm, 4, 10);
+    // Baked over the bounds and the unit cube, which between them see most versor lookups
+    BakedVersor* bakedVersor = 0;
+    Real bakeSpacing = 0;
+    if (versorBakeError > 0) {
+        AABB bakeBox = boundsBox;
+        bakeBox.extend(AABB(VEC3F(-1, -1, -1), VEC3F(1, 1, 1)));
+        bakeSpacing = BakedVersor::pickSpacing(versor, bakeBox, versorBakeError);
+
+        // Past maxVersorBakeRes samples per axis the lattice is coarsened, which loosens the bound
+        const VEC3I wanted = BakedVersor::resolution(bakeBox, bakeSpacing);
+        if (wanted.maxCoeff() > maxVersorBakeRes) {
+            bakeSpacing = bakeBox.span().maxCoeff() / (maxVersorBakeRes - 1);
+            const VEC3I capped = BakedVersor::resolution(bakeBox, bakeSpacing);
+            PRINTF("WARNING: BAKEVERSOR %g needs %dx%dx%d samples, over %d per axis; baking %dx%dx%d, which bounds the error by %.2e\n",
+                versorBakeError, wanted[0], wanted[1], wanted[2], maxVersorBakeRes, capped[0], capped[1], capped[2],
+                BakedVersor::errorBound(versor, bakeBox, bakeSpacing));
+        }
+
+        const VEC3I res = BakedVersor::resolution(bakeBox, bakeSpacing);
+        const double plannedMB = BakedVersor::plannedBytes(bakeBox, bakeSpacing) / pow(2.0, 20.0);
+        PRINTF("Baking the versor into %dx%dx%d samples (%.1f MB)\n", res[0], res[1], res[2], plannedMB);
+        if (plannedMB > maxVersorBakeMB) {
+            PRINTF("The versor bake needs more than %.0f MB; raise the BAKEVERSOR error target\n", maxVersorBakeMB);
+            exit(1);
+        }
 
-    vector<VEC3F> portalCenters;
-    vector<AngleAxis<Real>> portalRotations;
+        bakedVersor = new BakedVersor(&versor, bakeBox, bakeSpacing);
+        PRINTF("Baked the versor in %.2fs\n", bakedVersor->bakeSeconds);
+    }
+
+    VersorModulusR3Map vm(bakedVersor ? (R3Map*) bakedVersor : &versor, &modulus);
+    R3JuliaSet         mask_j(&vm, 4, 10);
 
     // READ PORTAL FILE
-    Real portalRadius;
-    Real portalScale;
-    VEC3F portalLocation;
-    AngleAxis<Real> portalRotation;
+    // Each portal runs from its location line to its rotation line. Its radius and scale
+    // default to the shared ones, wherever in the file those are given.
+    vector<PortalMap::Portal> portals;
+    Real portalRadius = 0;
+    Real portalScale = 1;
+    PortalMap::Portal portal;
+    bool hasRadius = false, hasScale = false;
+    vector<bool> ownRadius, ownScale; // whether each portal gave its own
 
     ifstream portalFile(argv[2]);
     if (portalFile.is_open()) {
@@ -136,20 +703,37 @@ int main(int argc, char *argv[]) {
                 } else if (key == "portal location") {
                     Real x,y,z;
                     sscanf(value.c_str(), " %lf %lf %lf", &x, &y, &z);
-                    portalLocation = VEC3F(x,y,z);
+                    portal = PortalMap::Portal();
+                    portal.center = VEC3F(x,y,z);
+                    hasRadius = hasScale = false;
+                } else if (key == "portal radius") {
+                    sscanf(value.c_str(), " %lf", &portal.radius);
+                    hasRadius = true;
+                } else if (key == "portal scale") {
+                    sscanf(value.c_str(), " %lf", &portal.scale);
+                    hasScale = true;
+                } else if (key == "portal output") {
+                    Real x,y,z;
+                    sscanf(value.c_str(), " %lf %lf %lf", &x, &y, &z);
+                    portal.outputCenter = VEC3F(x,y,z);
                 } else if (key == "portal rotation") {
                     Real t,x,y,z;
                     sscanf(value.c_str(), " %lf %lf %lf %lf", &t, &x, &y, &z);
-                    portalRotation = AngleAxis<Real>(t, VEC3F(x,y,z));
+                    portal.rotation = AngleAxis<Real>(t, VEC3F(x,y,z));
 
-                    portalCenters.push_back(portalLocation);
-                    portalRotations.push_back(portalRotation);
+                    portals.push_back(portal);
+                    ownRadius.push_back(hasRadius);
+                    ownScale.push_back(hasScale);
                 }
             }
         }
     }
     portalFile.close();
 
+    for (size_t i = 0; i < portals.size(); i++) {
+        if (!ownRadius[i]) portals[i].radius = portalRadius;
+        if (!ownScale[i]) portals[i].scale = portalScale;
+    }
 
     // FOR BUNNY EARS:
     // portalCenters.push_back(VEC3F(-0.175255, 0.441722, 0.015167));
@@ -158,7 +742,11 @@ int main(int argc, char *argv[]) {
     // portalCenters.push_back(VEC3F(-0.375654, 0.433278, -0.309944));
     // portalRotations.push_back(AngleAxis<Real>(0, VEC3F(0,1,0)));
 
-    PortalMap  pm(&vm, portalCenters, portalRotations, portalRadius, portalScale, &mask_j);
+    PortalMap  pm(&vm, portals, &mask_j);
+    if (maskGridRes > 0) {
+        pm.bakeMask(maskGridRes);
+        PRINTF("Baked portal mask disagrees with mask_j at %.2f%% of random points in the portals\n", 100 * pm.bakedMaskMismatch(10000));
+    }
 
     // FOR HEBE:
     // portalCenters.push_back(VEC3F(0.140000, 0.350699, 0.126944));
@@ -168,20 +756,104 @@ int main(int argc, char *argv[]) {
 
     R3JuliaSet julia(&pm, 7, 10);
 
-    VirtualGrid3DLimitedCache vg(res, res, res, boundsBox.min(), boundsBox.max(), &julia);
+    // Every lattice point at the full iteration count, a rough lower bound on what marching
+    // will ask for, since root finding adds more near the surface
+    if (bakedVersor) {
+        benchVersorBake(versor, *bakedVersor, bakeSpacing, benchPoints > 0 ? benchPoints : 100000, pow((double) res, 3) * julia.maxIterations);
+    }
+
+    if (benchPoints > 0) {
+        benchSDFStorage(*distFieldCoarse, benchPoints, sdfBand, narrowMin, narrowMax);
+        benchJuliaEngines(julia, boundsBox, benchPoints);
+        return 0;
+    }
+
+    // march_cubes keeps the corner planes of each slab itself, so the grid doesn't need a
+    // cache (and has to stay safe to query from several threads)
+    VirtualGrid3D vg(res, res, res, boundsBox.min(), boundsBox.max(), &julia);
+
+    // Same lattice, but blocks the SDF shows are far from the shell skip the iteration
+    ShellCulledJuliaGrid* culled = 0;
+    if (cullBlockSize > 0) {
+        culled = new ShellCulledJuliaGrid(res, res, res, boundsBox.min(), boundsBox.max(), &julia, &modulus, &pm, cullBlockSize);
+    }
 
     Mesh m;
-    MC::march_cubes(&vg, m, true);
+    Grid3D* marched = culled ? (Grid3D*) culled : &vg;
+    if (stream) {
+        streamMesh(marched, argv[11]);
+    } else if (tilesPerAxis > 1) {
+        // Octree tiles of the bounds, snapped to the lattice so neighbours share a plane
+        vector<AABB> tiles(1, boundsBox);
+        for (int n = 1; n < tilesPerAxis; n *= 2) {
+            vector<AABB> children;
+            for (AABB& tile : tiles) {
+                for (const AABB& child : tile.subdivideOctree()) children.push_back(child);
+            }
+            tiles.swap(children);
+        }
+
+        vector<VEC3I> windowMin, windowMax;
+        for (const AABB& tile : tiles) {
+            VEC3F lo = (tile.min() - boundsBox.min()).cwiseQuotient(boundsBox.span()) * res;
+            VEC3F hi = (tile.max() - boundsBox.min()).cwiseQuotient(boundsBox.span()) * res;
+            windowMin.push_back(lo.array().round().cast<int>().min(res - 1).matrix());
+            windowMax.push_back(hi.array().round().cast<int>().min(res - 1).matrix());
+        }
+
+        if (balanceRes > 1) {
+            const double start = omp_get_wtime();
+            CoarseCostSamples coarse(julia, vg, balanceRes);
+            PRINTF("Coarse cost pass at %d^3 took %.3fs\n", balanceRes, omp_get_wtime() - start);
+
+            // Root-finding cost per vertex, measured on a few surface edges. Failing that, bisection
+            // halves the bracket per evaluation until it is tol wide, so with tol 0 it spends its
+            // whole budget, and the others converge in far fewer.
+            double evalsPerEdge = coarse.measureEvalsPerEdge(marched, 64);
+            if (evalsPerEdge > 0) {
+                PRINTF("Measured %.2f root-finding evaluations per edge\n", evalsPerEdge);
+            } else if (MC::rootFinder == MC::LINEAR) {
+                evalsPerEdge = 1;
+            } else if (MC::rootFinder == MC::BISECTION) {
+                evalsPerEdge = (MC::rootFindingTolerance > 0) ?
+                    min<double>(MC::rootFindingMaxEvaluations, ceil(log2(1 / MC::rootFindingTolerance))) : MC::rootFindingMaxEvaluations;
+            } else {
+                evalsPerEdge = min(MC::rootFindingMaxEvaluations, 8u);
+            }
+
+            vector<double> cost;
+            for (size_t t = 0; t < windowMin.size(); t++)
+                cost.push_back(coarse.predict(windowMin[t], windowMax[t], julia.maxIterations, evalsPerEdge));
+            splitHotTiles(coarse, windowMin, windowMax, cost, julia.maxIterations, evalsPerEdge);
+
+            MC::march_cubes_tiled(marched, windowMin, windowMax, m, true, &cost);
+        } else {
+            MC::march_cubes_tiled(marched, windowMin, windowMax, m, true);
+        }
+    } else if (sparseBrickSize > 0) {
+        MC::march_cubes_sparse(marched, m, true, sparseBrickSize);
+    } else {
+        MC::march_cubes(marched, m, true);
+    }
+
+    if (culled) culled->printStats();
+    if (maskGridRes > 0) {
+        PRINTF("Baked portal mask answered %zu lookups, each a %d-iteration mask_j evaluation saved\n", pm.bakedMaskLookups(), mask_j.maxIterations);
+    }
 
     // Currently march_cubes doesn't take the grid's mapBox into account; all vertices are
     // placed in [ (0, xRes), (0, yRes), (0, zRes) ] space. TODO fix march_cubes to account for
     // the mapBox, but for now we'll just manually transform it. Normals should be okay as they are.
+    // (Through the marched grid, the way march_cubes_stream maps them, so the two round alike.)
     for (uint i = 0; i < m.vertices.size(); ++i) {
         VEC3F v = m.vertices[i];
-        m.vertices[i] = vg.gridToFieldCoords(v);
+        m.vertices[i] = marched->gridToFieldCoords(v);
     }
+    delete culled;
+    delete bakedVersor;
 
-    m.writeOBJ(argv[11]);
+    // Streamed meshes are already written, in field coordinates
+    if (!stream) m.write(argv[11]);
 
     return 0;
 }
@@ -6,22 +6,154 @@
 #include "SETTINGS.h"
 #include "makelevelset3.h"
 #include "field.h"
+#include "mesh.h"
 #include "projects/sdfGen/vec.h"
 
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <limits>
+#include <sys/resource.h>
+#include <unistd.h>
 
 using namespace std;
 
+// Generates the SDF with make_level_set3_tiled, streaming each z-slab into outname as soon as
+// it is done, so memory stays within budgetMB plus the mesh and its BVH. The files are laid
+// out the same as the in-memory path's below.
+static void generateTiled(const vector<Vec3ui>& faceList, const vector<Vec3f>& vertList,
+                          const Vec3f& min_box, const Vec3f& max_box, float dx, const Vec3ui& sizes,
+                          bool exact, double budgetMB, const string& outname)
+{
+    const int xRes = sizes[0], yRes = sizes[1], zRes = sizes[2];
+    const AABB bounds(VEC3F(min_box[0], min_box[1], min_box[2]), VEC3F(max_box[0], max_box[1], max_box[2]));
+    const bool f3dz = outname.size() > 5 && outname.substr(outname.size() - 5) == ".f3dz";
+    const int brickSize = F3D2File::defaultBrickSize;
+
+    // a float per cell for the slab, an int for the ray crossings unless signs come from
+    // winding numbers, and up to a float for the compressed bricks
+    const size_t cellBytes = 4 + (exact ? 0 : 4) + (f3dz ? 4 : 0);
+    int layers = min<double>(zRes, budgetMB * (1 << 20) / ((double) xRes * yRes * cellBytes));
+    if (f3dz && layers < zRes) layers -= layers % brickSize;
+    if (layers < (f3dz ? min(brickSize, zRes) : 1)) {
+        printf("A %.1f MB budget is too small for %dx%d slabs, the smallest needs %.1f MB!\n", budgetMB, xRes, yRes,
+            (double) xRes * yRes * cellBytes * (f3dz ? brickSize : 1) / (1 << 20));
+        exit(1);
+    }
+    printf("Generating %d layer slabs, %.1f MB each\n", layers, (double) xRes * yRes * layers * cellBytes / (1 << 20));
+
+    if (f3dz) {
+        // the same x and z swap as the in-memory path, which only works out for cubic grids
+        if (xRes != zRes) {
+            printf("Tiled .f3dz output needs as many x as z cells, not %d and %d!\n", xRes, zRes);
+            exit(1);
+        }
+        F3D2File::Writer writer(outname, xRes, yRes, zRes, bounds, F3D2File::FLOAT32, 0, brickSize);
+
+        make_level_set3_tiled(faceList, vertList, min_box, dx, xRes, yRes, zRes, layers, exact,
+            [&](const SDFArray3F& slab, int k_begin) {
+                // slab layers are the file's x bricks
+                vector<size_t> bricks;
+                for (size_t b = 0; b < writer.numBricks(); b++) {
+                    const int x = writer.brickOrigin(b).x();
+                    if (x >= k_begin && x < k_begin + slab.nk) bricks.push_back(b);
+                }
+                vector<vector<char>> payloads(bricks.size());
+                vector<uint32_t> codecs(bricks.size());
+                #pragma omp parallel for schedule(dynamic)
+                for (size_t n = 0; n < bricks.size(); n++) {
+                    const VEC3I o = writer.brickOrigin(bricks[n]);
+                    const VEC3I d = writer.brickDims(bricks[n]);
+                    vector<double> values((size_t) d.prod());
+                    size_t i = 0;
+                    for (int z = 0; z < d.z(); z++)
+                        for (int y = 0; y < d.y(); y++)
+                            for (int x = 0; x < d.x(); x++)
+                                values[i++] = slab(o.z() + z, o.y() + y, o.x() + x - k_begin);
+                    codecs[n] = F3D2File::encodeBrick(values.data(), values.size(), F3D2File::FLOAT32, 0, payloads[n]);
+                }
+                for (size_t n = 0; n < bricks.size(); n++)
+                    writer.writeBrick(bricks[n], payloads[n], codecs[n]);
+            });
+
+        const uint64_t bytes = writer.close();
+        printf("Wrote %s: %.2f MB, %.2fx smaller than raw doubles\n", outname.c_str(), bytes / pow(2.0, 20.0),
+            (double) xRes * yRes * zRes * sizeof(double) / bytes);
+    } else {
+        FILE* file = fopen(outname.c_str(), "wb");
+        if (file == NULL) {
+            printf("Failed to write F3D %s: file open failed!\n", outname.c_str());
+            exit(1);
+        }
+        fwrite(&xRes, sizeof(int), 1, file);
+        fwrite(&yRes, sizeof(int), 1, file);
+        fwrite(&zRes, sizeof(int), 1, file);
+        MyEigen::write_vec3f(file, bounds.center());
+        MyEigen::write_vec3f(file, bounds.span());
+        fflush(file);
+        const off_t header = ftell(file);
+
+        // v1 files are x-outer, so a slab is a run of z values for every (x, y)
+        make_level_set3_tiled(faceList, vertList, min_box, dx, xRes, yRes, zRes, layers, exact,
+            [&](const SDFArray3F& slab, int k_begin) {
+                vector<double> run(slab.nk);
+                for (int x = 0; x < xRes; x++) {
+                    for (int y = 0; y < yRes; y++) {
+                        for (int z = 0; z < slab.nk; z++)
+                            run[z] = slab(x, y, z);
+                        const off_t at = header + (((off_t) x * yRes + y) * zRes + k_begin) * sizeof(double);
+                        if (pwrite(fileno(file), run.data(), run.size() * sizeof(double), at) != (ssize_t) (run.size() * sizeof(double))) {
+                            printf("Failed to write F3D %s: write failed!\n", outname.c_str());
+                            exit(1);
+                        }
+                    }
+                }
+            });
+        fclose(file);
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("Peak memory: %.1f MB\n", usage.ru_maxrss / 1024.0);
+}
+
 
 int main(int argc, char* argv[]) {
 
+    // EXACT selects the BVH generation mode and TILED <MB> the out-of-core one, in either
+    // order; otherwise they take the same parameters
+    bool exact = false;
+    double tiledMB = 0;
+    while (argc > 1) {
+        if (string(argv[1]) == "EXACT") {
+            exact = true;
+            argv++;
+            argc--;
+        } else if (string(argv[1]) == "TILED" && argc > 2) {
+            tiledMB = atof(argv[2]);
+            if (tiledMB <= 0) {
+                cerr << "TILED needs a memory budget in MB, not " << argv[2] << endl;
+                exit(-1);
+            }
+            argv += 2;
+            argc -= 2;
+        } else {
+            break;
+        }
+    }
+
     if(argc < 2) {
         cout << "USAGE: " << endl;
         cout << "To generate an SDF from a mesh with automatically generated bounds:" << endl;
         cout << " " << argv[0] << " <*.obj input> <resolution> <*.f3d output> <padding cells>\n";
+        cout << "Output names ending in .f3dz are written as bricked, compressed F3D v2." << endl;
+        cout << "Put EXACT before the mesh to compute every distance exactly with a BVH, and signs from winding" << endl;
+        cout << "numbers so that meshes with holes work too (slower than the default fast sweeping):" << endl;
+        cout << " " << argv[0] << " EXACT <*.obj input> <resolution> <*.f3d output> <padding cells>\n";
+        cout << "Put TILED <MB> before the mesh to compute the SDF in z-slabs that are written out as they finish," << endl;
+        cout << "keeping memory within <MB> plus the mesh. Distances are exact as with EXACT, and signs come from ray" << endl;
+        cout << "parity unless EXACT is also given:" << endl;
+        cout << " " << argv[0] << " TILED <MB> [EXACT] <*.obj input> <resolution> <*.f3d output> <padding cells>\n";
         cout << "To get the bounds for a mesh sequence:" << endl;
         cout << " " << argv[0] << " BOUNDS <obj 1> <obj 2> ... <obj N>\n";
         cout << "To generate an SDF from a mesh with specified bounds:" << endl;
@@ -43,42 +175,12 @@ int main(int argc, char* argv[]) {
             }
 
             cout << "Reading data.\n";
+            OBJReader<float> obj(filename);
+            for (size_t v = 0; v < obj.numVertices(); v++)
+                update_minmax(Vec3f(&obj.positions[3 * v]), min_box, max_box);
 
-            ifstream infile(argv[i]);
-            if(!infile) {
-                cerr << "Failed to open " << argv[i] << " Terminating.\n";
-                exit(-1);
-            }
-
-            int ignored_lines = 0;
-            int total_lines = 0;
-            string line;
-            while(!infile.eof()) {
-                getline(infile, line);
-
-                //.obj files sometimes contain vertex normals indicated by "vn"
-                if(line.substr(0,1) == string("v") && line.substr(0,2) != string("vn")){
-                    stringstream data(line);
-                    char c;
-                    Vec3f point;
-                    data >> c >> point[0] >> point[1] >> point[2];
-                    update_minmax(point, min_box, max_box);
-                }
-                else if( line.substr(0,2) == string("vn") ){
-                    cerr << "Obj-loader is not able to parse vertex normals, please strip them from the input file. \n";
-                    exit(-2);
-                }
-                else if(line.substr(0,1) == string("f")) { }
-                else {
-                    ++ignored_lines;
-                }
-                ++total_lines;
-            }
-            infile.close();
-
-            if(ignored_lines > 0)
-                cout << "Warning: " << ignored_lines << " of " << total_lines << " lines were ignored since they did not contain faces or vertices.\n";
-
+            if(obj.ignoredLines > 0)
+                cout << "Warning: " << obj.ignoredLines << " lines were ignored since they did not contain faces or vertices.\n";
         }
 
         PRINTV3(min_box);
@@ -106,48 +208,18 @@ int main(int argc, char* argv[]) {
           max_box(-numeric_limits<float>::max(),-numeric_limits<float>::max(),-numeric_limits<float>::max());
 
     cout << "Reading data.\n";
-
-    ifstream infile(argv[1]);
-    if(!infile) {
-        cerr << "Failed to open. Terminating.\n";
-        exit(-1);
-    }
-
-    int ignored_lines = 0;
-    string line;
-    vector<Vec3f> vertList;
-    vector<Vec3ui> faceList;
-    while(!infile.eof()) {
-        getline(infile, line);
-
-        //.obj files sometimes contain vertex normals indicated by "vn"
-        if(line.substr(0,1) == string("v") && line.substr(0,2) != string("vn")){
-            stringstream data(line);
-            char c;
-            Vec3f point;
-            data >> c >> point[0] >> point[1] >> point[2];
-            vertList.push_back(point);
-            update_minmax(point, min_box, max_box);
-        }
-        else if(line.substr(0,1) == string("f")) {
-            stringstream data(line);
-            char c;
-            int v0,v1,v2;
-            data >> c >> v0 >> v1 >> v2;
-            faceList.push_back(Vec3ui(v0-1,v1-1,v2-1));
-        }
-        else if( line.substr(0,2) == string("vn") ){
-            cerr << "Obj-loader is not able to parse vertex normals, please strip them from the input file. \n";
-            exit(-2);
-        }
-        else {
-            ++ignored_lines;
-        }
+    OBJReader<float> obj(filename);
+    vector<Vec3f> vertList(obj.numVertices());
+    vector<Vec3ui> faceList(obj.numTriangles());
+    for (size_t v = 0; v < vertList.size(); v++) {
+        vertList[v] = Vec3f(&obj.positions[3 * v]);
+        update_minmax(vertList[v], min_box, max_box);
     }
-    infile.close();
+    for (size_t t = 0; t < faceList.size(); t++)
+        faceList[t] = Vec3ui(&obj.indices[3 * t]);
 
-    if(ignored_lines > 0)
-        cout << "Warning: " << ignored_lines << " lines were ignored since they did not contain faces or vertices.\n";
+    if(obj.ignoredLines > 0)
+        cout << "Warning: " << obj.ignoredLines << " lines were ignored since they did not contain faces or vertices.\n";
 
     cout << "Read in " << vertList.size() << " vertices and " << faceList.size() << " faces." << endl;
 
@@ -203,11 +275,22 @@ int main(int argc, char* argv[]) {
     dx = lengths[0] / res;
     Vec3ui sizes = Vec3ui((max_box - min_box)/dx);
 
+    string outname(argv[3]);
+
     cout << "Computing signed distance field.\n";
-    SDFArray3F phi_grid;
-    make_level_set3(faceList, vertList, min_box, dx, sizes[0], sizes[1], sizes[2], phi_grid);
+    if (tiledMB > 0) {
+        cout << "Writing results to: " << outname << "\n";
+        generateTiled(faceList, vertList, min_box, max_box, dx, sizes, exact, tiledMB, outname);
+        cout << "Processing complete.\n";
+        return 0;
+    }
 
-    string outname(argv[3]);
+    SDFArray3F phi_grid;
+    if (exact) {
+        make_level_set3_exact(faceList, vertList, min_box, dx, sizes[0], sizes[1], sizes[2], phi_grid);
+    } else {
+        make_level_set3(faceList, vertList, min_box, dx, sizes[0], sizes[1], sizes[2], phi_grid);
+    }
 
     //Very hackily strip off file suffix.
     cout << "Writing results to: " << outname << "\n";
@@ -234,7 +317,21 @@ int main(int argc, char* argv[]) {
             for (int x = 0; x < xRes; x++)
                 field.at(x,y,z) = phi_grid(x,y,z);
 
-    field.writeF3D(outname, true);
+    if (outname.size() > 5 && outname.substr(outname.size() - 5) == ".f3dz") {
+        // F3D v2 reads back exactly as written, so store the values the way ArrayGrid3D
+        // lays out a v1 file (see Grid3D::writeF3D), keeping both formats interchangeable.
+        // The distances are computed in float, so float32 storage loses nothing.
+        ArrayGrid3D asRead(xRes, yRes, zRes);
+        asRead.setMapBox(field.mapBox);
+        size_t i = 0;
+        for (int x = 0; x < xRes; x++)
+            for (int y = 0; y < yRes; y++)
+                for (int z = 0; z < zRes; z++)
+                    asRead[i++] = field.get(x, y, z);
+        asRead.writeF3D2(outname, true, F3D2File::FLOAT32);
+    } else {
+        field.writeF3D(outname, true);
+    }
 
     cout << "Processing complete.\n";
 
@@ -1,6 +1,8 @@
 #include "makelevelset3.h"
 #include "SETTINGS.h"
 
+#include <algorithm>
+
 // find distance x0 is from segment x1-x2
 static float point_segment_distance(const Vec3f &x0, const Vec3f &x1, const Vec3f &x2)
 {
@@ -55,29 +57,42 @@ static void check_neighbour(const std::vector<Vec3ui> &tri, const std::vector<Ve
     }
 }
 
-static void sweep(const std::vector<Vec3ui> &tri, const std::vector<Vec3f> &x,
+static void sweep_row(const std::vector<Vec3ui> &tri, const std::vector<Vec3f> &x,
     SDFArray3F &phi, SDFArray3I &closest_tri, const Vec3f &origin, float dx,
-    int di, int dj, int dk)
+    int di, int dj, int dk, int j, int k)
 {
     int i0, i1;
     if(di>0){ i0=1; i1=phi.ni; }
     else{ i0=phi.ni-2; i1=-1; }
-    int j0, j1;
-    if(dj>0){ j0=1; j1=phi.nj; }
-    else{ j0=phi.nj-2; j1=-1; }
-    int k0, k1;
-    if(dk>0){ k0=1; k1=phi.nk; }
-    else{ k0=phi.nk-2; k1=-1; }
-    for(int k=k0; k!=k1; k+=dk) {
-        for(int j=j0; j!=j1; j+=dj) for(int i=i0; i!=i1; i+=di){
-            Vec3f gx(i*dx+origin[0], j*dx+origin[1], k*dx+origin[2]);
-            check_neighbour(tri, x, phi, closest_tri, gx, i, j, k, i-di, j,    k);
-            check_neighbour(tri, x, phi, closest_tri, gx, i, j, k, i,    j-dj, k);
-            check_neighbour(tri, x, phi, closest_tri, gx, i, j, k, i-di, j-dj, k);
-            check_neighbour(tri, x, phi, closest_tri, gx, i, j, k, i,    j,    k-dk);
-            check_neighbour(tri, x, phi, closest_tri, gx, i, j, k, i-di, j,    k-dk);
-            check_neighbour(tri, x, phi, closest_tri, gx, i, j, k, i,    j-dj, k-dk);
-            check_neighbour(tri, x, phi, closest_tri, gx, i, j, k, i-di, j-dj, k-dk);
+    for(int i=i0; i!=i1; i+=di){
+        Vec3f gx(i*dx+origin[0], j*dx+origin[1], k*dx+origin[2]);
+        check_neighbour(tri, x, phi, closest_tri, gx, i, j, k, i-di, j,    k);
+        check_neighbour(tri, x, phi, closest_tri, gx, i, j, k, i,    j-dj, k);
+        check_neighbour(tri, x, phi, closest_tri, gx, i, j, k, i-di, j-dj, k);
+        check_neighbour(tri, x, phi, closest_tri, gx, i, j, k, i,    j,    k-dk);
+        check_neighbour(tri, x, phi, closest_tri, gx, i, j, k, i-di, j,    k-dk);
+        check_neighbour(tri, x, phi, closest_tri, gx, i, j, k, i,    j-dj, k-dk);
+        check_neighbour(tri, x, phi, closest_tri, gx, i, j, k, i-di, j-dj, k-dk);
+    }
+}
+
+// A cell only reads the neighbours before it along each sweep direction, so row (j,k) only
+// needs rows (j-dj,k), (j,k-dk) and (j-dj,k-dk) to be done. Rows on one anti-diagonal of the
+// (j,k) plane are independent, and sweeping the diagonals in order gives the same result as
+// the serial k, j, i loop.
+static void sweep(const std::vector<Vec3ui> &tri, const std::vector<Vec3f> &x,
+    SDFArray3F &phi, SDFArray3I &closest_tri, const Vec3f &origin, float dx,
+    int di, int dj, int dk)
+{
+    const int rows_j=phi.nj-1, rows_k=phi.nk-1;
+    const int j0=(dj>0) ? 1 : phi.nj-2;
+    const int k0=(dk>0) ? 1 : phi.nk-2;
+    #pragma omp parallel
+    for(int diagonal=0; diagonal<rows_j+rows_k-1; ++diagonal){
+        const int a0=std::max(0, diagonal-rows_k+1), a1=std::min(diagonal, rows_j-1);
+        #pragma omp for schedule(static)
+        for(int a=a0; a<=a1; ++a){
+            sweep_row(tri, x, phi, closest_tri, origin, dx, di, dj, dk, j0+a*dj, k0+(diagonal-a)*dk);
         }
     }
 }
@@ -118,6 +133,43 @@ static bool point_in_triangle_2d(double x0, double y0,
     return true;
 }
 
+// Counts ray crossings for the rows of intersection_count, which holds layers
+// [k_begin, k_begin+intersection_count.nk) of an ni x nj x ? grid: intersection_count(i,j,k)
+// is # of tri intersections in (i-1,i]x{j}x{k}. The rays run along x, so a slab of layers
+// holds whole rays. Counts only add up, so their order doesn't matter.
+static void count_intersections(const std::vector<Vec3ui> &tri, const std::vector<Vec3f> &x,
+    const Vec3f &origin, float dx, int ni, int nj, int k_begin, SDFArray3I &intersection_count)
+{
+    const int nk=intersection_count.nk;
+    #pragma omp parallel for schedule(dynamic, 1024)
+    for(unsigned int t=0; t<tri.size(); ++t){
+        unsigned int p, q, r; assign(tri[t], p, q, r);
+        // coordinates are those of the whole grid, so every slab tests the same values
+        const double fip=((double)x[p][0]-origin[0])/dx, fjp=((double)x[p][1]-origin[1])/dx, fkp=((double)x[p][2]-origin[2])/dx;
+        const double fiq=((double)x[q][0]-origin[0])/dx, fjq=((double)x[q][1]-origin[1])/dx, fkq=((double)x[q][2]-origin[2])/dx;
+        const double fir=((double)x[r][0]-origin[0])/dx, fjr=((double)x[r][1]-origin[1])/dx, fkr=((double)x[r][2]-origin[2])/dx;
+        if(max(fkp,fkq,fkr)<k_begin || min(fkp,fkq,fkr)>k_begin+nk-1) continue;
+        int j0=clamp((int)std::ceil(min(fjp,fjq,fjr)), 0, nj-1);
+        int j1=clamp((int)std::floor(max(fjp,fjq,fjr)), 0, nj-1);
+        int k0=clamp((int)std::ceil(min(fkp,fkq,fkr))-k_begin, 0, nk-1);
+        int k1=clamp((int)std::floor(max(fkp,fkq,fkr))-k_begin, 0, nk-1);
+        for(int k=k0; k<=k1; ++k) for(int j=j0; j<=j1; ++j){
+            double a, b, c;
+            if(point_in_triangle_2d(j, k+k_begin, fjp, fkp, fjq, fkq, fjr, fkr, a, b, c)){
+                double fi=a*fip+b*fiq+c*fir; // intersection i coordinate
+                int i_interval=int(std::ceil(fi)); // intersection is in (i_interval-1,i_interval]
+                // we enlarge the first interval to include everything to the -x direction, and
+                // ignore intersections that are beyond the +x side of the grid
+                if(i_interval<ni){
+                    int &count=intersection_count(std::max(i_interval, 0), j, k);
+                    #pragma omp atomic
+                    ++count;
+                }
+            }
+        }
+    }
+}
+
 void make_level_set3(const std::vector<Vec3ui> &tri, const std::vector<Vec3f> &x,
     const Vec3f &origin, float dx, int ni, int nj, int nk,
     SDFArray3F &phi, const int exact_band)
@@ -129,44 +181,80 @@ void make_level_set3(const std::vector<Vec3ui> &tri, const std::vector<Vec3f> &x
     // we begin by initializing distances near the mesh, and figuring out intersection counts
     Vec3f ijkmin, ijkmax;
 
+    // Grid coordinates of triangle t's corners to high precision
+    auto grid_coords=[&](unsigned int t, double f[3][3]){
+        unsigned int v[3]; assign(tri[t], v[0], v[1], v[2]);
+        for(int c=0; c<3; ++c) for(int a=0; a<3; ++a) f[c][a]=((double)x[v[c]][a]-origin[a])/dx;
+    };
+    // Cells within exact_band of triangle t, inclusive
+    auto band_box=[&](const double f[3][3], int lo[3], int hi[3]){
+        const int n[3]={ni, nj, nk};
+        for(int a=0; a<3; ++a){
+            lo[a]=clamp(int(min(f[0][a],f[1][a],f[2][a]))-exact_band, 0, n[a]-1);
+            hi[a]=clamp(int(max(f[0][a],f[1][a],f[2][a]))+exact_band+1, 0, n[a]-1);
+        }
+    };
+
+    // Bin the triangles into tiles of cells, keeping each bin in triangle order. Threads then
+    // own whole tiles, and every cell still sees its triangles in the serial order, so ties
+    // between equally close triangles resolve the same way.
+    const int tile=16;
+    const int ti=(ni+tile-1)/tile, tj=(nj+tile-1)/tile, tk=(nk+tile-1)/tile;
+    std::vector<size_t> bin_start((size_t)ti*tj*tk+1, 0);
+    std::vector<unsigned int> bin_tris;
+    for(int fill=0; fill<2; ++fill){
+        std::vector<size_t> next(bin_start.begin(), bin_start.end()-1);
+        for(unsigned int t=0; t<tri.size(); ++t){
+            double f[3][3]; int lo[3], hi[3];
+            grid_coords(t, f);
+            band_box(f, lo, hi);
+            for(int k=lo[2]/tile; k<=hi[2]/tile; ++k) for(int j=lo[1]/tile; j<=hi[1]/tile; ++j) for(int i=lo[0]/tile; i<=hi[0]/tile; ++i){
+                const size_t b=((size_t)k*tj+j)*ti+i;
+                if(fill) bin_tris[next[b]++]=t;
+                else ++bin_start[b+1];
+            }
+        }
+        if(!fill){
+            for(size_t b=0; b+1<bin_start.size(); ++b) bin_start[b+1]+=bin_start[b];
+            bin_tris.resize(bin_start.back());
+        }
+    }
+
     PB_START("Initializing distances near mesh");
-    for(unsigned int t=0; t<tri.size(); ++t){
-        unsigned int p, q, r; assign(tri[t], p, q, r);
-        // coordinates in grid to high precision
-        double fip=((double)x[p][0]-origin[0])/dx, fjp=((double)x[p][1]-origin[1])/dx, fkp=((double)x[p][2]-origin[2])/dx;
-        double fiq=((double)x[q][0]-origin[0])/dx, fjq=((double)x[q][1]-origin[1])/dx, fkq=((double)x[q][2]-origin[2])/dx;
-        double fir=((double)x[r][0]-origin[0])/dx, fjr=((double)x[r][1]-origin[1])/dx, fkr=((double)x[r][2]-origin[2])/dx;
-        // do distances nearby
-        int i0=clamp(int(min(fip,fiq,fir))-exact_band, 0, ni-1), i1=clamp(int(max(fip,fiq,fir))+exact_band+1, 0, ni-1);
-        int j0=clamp(int(min(fjp,fjq,fjr))-exact_band, 0, nj-1), j1=clamp(int(max(fjp,fjq,fjr))+exact_band+1, 0, nj-1);
-        int k0=clamp(int(min(fkp,fkq,fkr))-exact_band, 0, nk-1), k1=clamp(int(max(fkp,fkq,fkr))+exact_band+1, 0, nk-1);
-        for(int k=k0; k<=k1; ++k) for(int j=j0; j<=j1; ++j) for(int i=i0; i<=i1; ++i){
-            Vec3f gx(i*dx+origin[0], j*dx+origin[1], k*dx+origin[2]);
-            float d=point_triangle_distance(gx, x[p], x[q], x[r]);
-            if(d<phi(i,j,k)){
-                phi(i,j,k)=d;
-                closest_tri(i,j,k)=t;
+    size_t tiles_done=0;
+    #pragma omp parallel for schedule(dynamic)
+    for(size_t b=0; b<(size_t)ti*tj*tk; ++b){
+        const int tile_lo[3]={ (int)(b%ti)*tile, (int)((b/ti)%tj)*tile, (int)(b/((size_t)ti*tj))*tile };
+        for(size_t n=bin_start[b]; n<bin_start[b+1]; ++n){
+            const unsigned int t=bin_tris[n];
+            unsigned int p, q, r; assign(tri[t], p, q, r);
+            double f[3][3]; int lo[3], hi[3];
+            grid_coords(t, f);
+            band_box(f, lo, hi);
+            const int i0=std::max(lo[0], tile_lo[0]), i1=std::min(hi[0], tile_lo[0]+tile-1);
+            const int j0=std::max(lo[1], tile_lo[1]), j1=std::min(hi[1], tile_lo[1]+tile-1);
+            const int k0=std::max(lo[2], tile_lo[2]), k1=std::min(hi[2], tile_lo[2]+tile-1);
+            for(int k=k0; k<=k1; ++k) for(int j=j0; j<=j1; ++j) for(int i=i0; i<=i1; ++i){
+                Vec3f gx(i*dx+origin[0], j*dx+origin[1], k*dx+origin[2]);
+                float d=point_triangle_distance(gx, x[p], x[q], x[r]);
+                if(d<phi(i,j,k)){
+                    phi(i,j,k)=d;
+                    closest_tri(i,j,k)=t;
+                }
             }
         }
-        // and do intersection counts
-        j0=clamp((int)std::ceil(min(fjp,fjq,fjr)), 0, nj-1);
-        j1=clamp((int)std::floor(max(fjp,fjq,fjr)), 0, nj-1);
-        k0=clamp((int)std::ceil(min(fkp,fkq,fkr)), 0, nk-1);
-        k1=clamp((int)std::floor(max(fkp,fkq,fkr)), 0, nk-1);
-        for(int k=k0; k<=k1; ++k) for(int j=j0; j<=j1; ++j){
-            double a, b, c;
-            if(point_in_triangle_2d(j, k, fjp, fkp, fjq, fkq, fjr, fkr, a, b, c)){
-                double fi=a*fip+b*fiq+c*fir; // intersection i coordinate
-                int i_interval=int(std::ceil(fi)); // intersection is in (i_interval-1,i_interval]
-                if(i_interval<0) ++intersection_count(0, j, k); // we enlarge the first interval to include everything to the -x direction
-                else if(i_interval<ni) ++intersection_count(i_interval,j,k);
-                // we ignore intersections that are beyond the +x side of the grid
+        #pragma omp critical
+        {
+            if(++tiles_done % 64 == 0) {
+                PB_PROGRESS((float) tiles_done / ((size_t)ti*tj*tk));
             }
         }
-        PB_PROGRESS((float) t / tri.size());
     }
     PB_END();
 
+    // and do intersection counts
+    count_intersections(tri, x, origin, dx, ni, nj, 0, intersection_count);
+
 
     PB_STARTD("Filling in distances not near mesh using fast sweeping");
     // and now we fill in the rest of the distances with fast sweeping
@@ -191,7 +279,8 @@ void make_level_set3(const std::vector<Vec3ui> &tri, const std::vector<Vec3f> &x
     PB_END();
 
     PB_STARTD("Setting signs");
-    // then figure out signs (inside/outside) from intersection counts
+    // then figure out signs (inside/outside) from intersection counts, each row on its own
+    #pragma omp parallel for schedule(static)
     for(int k=0; k<nk; ++k) {
         for(int j=0; j<nj; ++j){
             int total_count=0;
@@ -202,8 +291,283 @@ void make_level_set3(const std::vector<Vec3ui> &tri, const std::vector<Vec3f> &x
                 }
             }
         }
-        PB_PROGRESS((float) k / nk);
     }
+    PB_PROGRESS(1);
+
+}
+
+
+namespace {
+
+// Bounding volume hierarchy over the triangles, for exact closest-triangle queries. Each node
+// also keeps the first-order far field of its triangles for fast winding numbers (Barill et
+// al. 2018): their summed area vector, area-weighted centre and a radius around the centre
+// that holds every vertex.
+struct TriangleBVH
+{
+    struct Node {
+        Vec3f lo, hi;
+        int left, right;   // children, or -1 in a leaf
+        int first, count;  // range of order[] in a leaf
+        Vec3d normal, center;
+        double area, radius;
+    };
+
+    static const int leaf_size=4;
+
+    const std::vector<Vec3ui> &tri;
+    const std::vector<Vec3f> &x;
+    std::vector<Node> nodes;
+    std::vector<unsigned int> order;
+    std::vector<Vec3f> centroids;
+
+    TriangleBVH(const std::vector<Vec3ui> &tri, const std::vector<Vec3f> &x): tri(tri), x(x)
+    {
+        order.resize(tri.size());
+        centroids.resize(tri.size());
+        for(unsigned int t=0; t<tri.size(); ++t){
+            order[t]=t;
+            centroids[t]=(x[tri[t][0]]+x[tri[t][1]]+x[tri[t][2]])/3.f;
+        }
+        nodes.reserve(2*tri.size()/leaf_size+1);
+        if(!tri.empty()) build(0, tri.size());
+    }
+
+    int build(int first, int count)
+    {
+        const int index=nodes.size();
+        nodes.push_back(Node());
+        Vec3f lo=x[tri[order[first]][0]], hi=lo, clo=centroids[order[first]], chi=clo;
+        for(int n=first; n<first+count; ++n){
+            for(int c=0; c<3; ++c){
+                lo=min_union(lo, x[tri[order[n]][c]]);
+                hi=max_union(hi, x[tri[order[n]][c]]);
+            }
+            clo=min_union(clo, centroids[order[n]]);
+            chi=max_union(chi, centroids[order[n]]);
+        }
+
+        int left=-1, right=-1;
+        if(count>leaf_size){
+            Vec3f extent=chi-clo;
+            int axis=(extent[0]>=extent[1] && extent[0]>=extent[2]) ? 0 : (extent[1]>=extent[2] ? 1 : 2);
+            std::nth_element(order.begin()+first, order.begin()+first+count/2, order.begin()+first+count,
+                [&](unsigned int a, unsigned int b){ return centroids[a][axis]<centroids[b][axis]; });
+            left=build(first, count/2);
+            right=build(first+count/2, count-count/2);
+        }
+
+        Node &node=nodes[index];
+        node.lo=lo; node.hi=hi;
+        node.left=left; node.right=right;
+        node.first=first; node.count=count;
+        node.normal=Vec3d(0,0,0); node.center=Vec3d(0,0,0); node.area=0; node.radius=0;
+        if(left<0){
+            for(int n=first; n<first+count; ++n){
+                Vec3d v0(x[tri[order[n]][0]]), v1(x[tri[order[n]][1]]), v2(x[tri[order[n]][2]]);
+                Vec3d area_vector=0.5*cross(v1-v0, v2-v0);
+                double area=mag(area_vector);
+                node.normal+=area_vector;
+                node.center+=area*(v0+v1+v2)/3.0;
+                node.area+=area;
+            }
+            node.center=(node.area>0) ? node.center/node.area : Vec3d((lo+hi)/2.f);
+            for(int n=first; n<first+count; ++n)
+                for(int c=0; c<3; ++c)
+                    node.radius=std::max(node.radius, dist(node.center, Vec3d(x[tri[order[n]][c]])));
+        }else{
+            const Node &l=nodes[left], &r=nodes[right];
+            node.normal=l.normal+r.normal;
+            node.area=l.area+r.area;
+            node.center=(node.area>0) ? (l.area*l.center+r.area*r.center)/node.area : Vec3d((lo+hi)/2.f);
+            node.radius=std::max(dist(node.center, l.center)+l.radius, dist(node.center, r.center)+r.radius);
+        }
+        return index;
+    }
+
+    static double box_distance2(const Node &node, const Vec3f &p)
+    {
+        double d2=0;
+        for(int a=0; a<3; ++a){
+            double d=std::max(std::max((double)node.lo[a]-p[a], (double)p[a]-node.hi[a]), 0.0);
+            d2+=d*d;
+        }
+        return d2;
+    }
+
+    // Lowers best to the distance from p to the closest triangle, and sets best_tri to it.
+    // Boxes are only skipped when clearly farther than best, so the float triangle distances
+    // decide ties exactly as a brute force minimum would.
+    void closest(const Vec3f &p, float &best, int &best_tri) const
+    {
+        int stack[64];
+        int size=0;
+        if(!nodes.empty()) stack[size++]=0;
+        while(size>0){
+            const Node &node=nodes[stack[--size]];
+            const double bound=(double)best*(1+1e-5);
+            if(box_distance2(node, p)>bound*bound) continue;
+            if(node.left<0){
+                for(int n=node.first; n<node.first+node.count; ++n){
+                    unsigned int a, b, c; assign(tri[order[n]], a, b, c);
+                    float d=point_triangle_distance(p, x[a], x[b], x[c]);
+                    if(d<best || (d==best && (int)order[n]<best_tri)){
+                        best=d;
+                        best_tri=order[n];
+                    }
+                }
+                continue;
+            }
+            // visit the nearer child first
+            const double dl=box_distance2(nodes[node.left], p), dr=box_distance2(nodes[node.right], p);
+            stack[size++]=(dl<dr) ? node.right : node.left;
+            stack[size++]=(dl<dr) ? node.left : node.right;
+        }
+    }
+
+    // Generalized winding number of the triangles around q: about 1 (or -1, for an inward
+    // facing mesh) inside a closed mesh and 0 outside, varying smoothly across holes. Nodes
+    // farther than beta times their radius use their dipole far field.
+    double winding_number(const Vec3d &q, double beta=2) const
+    {
+        int stack[64];
+        int size=0;
+        if(!nodes.empty()) stack[size++]=0;
+        double solid_angle=0;
+        while(size>0){
+            const Node &node=nodes[stack[--size]];
+            Vec3d d=node.center-q;
+            double d2=mag2(d);
+            if(d2>beta*beta*node.radius*node.radius){
+                solid_angle+=dot(d, node.normal)/(d2*sqrt(d2));
+            }else if(node.left<0){
+                for(int n=node.first; n<node.first+node.count; ++n){
+                    Vec3d a=Vec3d(x[tri[order[n]][0]])-q, b=Vec3d(x[tri[order[n]][1]])-q, c=Vec3d(x[tri[order[n]][2]])-q;
+                    double la=mag(a), lb=mag(b), lc=mag(c);
+                    solid_angle+=2*atan2(triple(a, b, c), la*lb*lc+dot(a,b)*lc+dot(b,c)*la+dot(c,a)*lb);
+                }
+            }else{
+                stack[size++]=node.left;
+                stack[size++]=node.right;
+            }
+        }
+        return solid_angle/(4*M_PI);
+    }
+};
 
 }
 
+// In a closed, consistently oriented mesh every directed edge has exactly one twin going
+// the other way. The winding number is then a whole number off the surface, so it can
+// only change between neighbouring cells if the surface passes within dx of them.
+static bool is_closed(const std::vector<Vec3ui> &tri)
+{
+    std::vector<unsigned long long> edges;
+    edges.reserve(3*tri.size());
+    for(unsigned int t=0; t<tri.size(); ++t)
+        for(int c=0; c<3; ++c)
+            edges.push_back((unsigned long long)tri[t][c]<<32 | tri[t][(c+1)%3]);
+    std::sort(edges.begin(), edges.end());
+    bool closed=std::adjacent_find(edges.begin(), edges.end())==edges.end();
+    for(size_t e=0; closed && e<edges.size(); ++e){
+        const unsigned long long twin=(edges[e]<<32) | (edges[e]>>32);
+        closed=std::binary_search(edges.begin(), edges.end(), twin);
+    }
+    printf("Mesh is %s: %s\n", closed ? "closed" : "open",
+        closed ? "winding numbers are only evaluated near the surface" : "evaluating the winding number at every cell");
+    return closed;
+}
+
+// Fills phi, which holds layers [k_begin, k_begin+phi.nk) of the grid, with exact distances.
+// Signs come from winding numbers, or from ray parity if intersection_count is given.
+static void exact_slab(const TriangleBVH &bvh, bool closed,
+    const std::vector<Vec3ui> &tri, const std::vector<Vec3f> &x,
+    const Vec3f &origin, float dx, int k_begin, SDFArray3F &phi,
+    const SDFArray3I *intersection_count, const char *description)
+{
+    const int ni=phi.ni, nj=phi.nj, nk=phi.nk;
+    PB_START("%s", description);
+    size_t rows_done=0;
+    #pragma omp parallel for schedule(dynamic)
+    for(int row=0; row<nj*nk; ++row){
+        const int j=row%nj, k=row/nj;
+        int best_tri=-1;
+        bool inside=false;
+        int total_count=0;
+        for(int i=0; i<ni; ++i){
+            Vec3f gx(i*dx+origin[0], j*dx+origin[1], (k_begin+k)*dx+origin[2]);
+            // the previous cell's closest triangle bounds the search
+            float best=std::numeric_limits<float>::infinity();
+            if(best_tri>=0){
+                unsigned int p, q, r; assign(tri[best_tri], p, q, r);
+                best=point_triangle_distance(gx, x[p], x[q], x[r]);
+            }
+            bvh.closest(gx, best, best_tri);
+            if(intersection_count){
+                total_count+=(*intersection_count)(i,j,k);
+                inside=total_count%2==1;
+            }
+            // no surface between this cell and the previous one if it is more than dx away
+            else if(!closed || i==0 || best<=dx){
+                inside=std::fabs(bvh.winding_number(Vec3d(gx)))>0.5;
+            }
+            phi(i,j,k)=inside ? -best : best;
+        }
+        #pragma omp critical
+        {
+            if(++rows_done % 256 == 0) {
+                PB_PROGRESS((float) rows_done / (nj*nk));
+            }
+        }
+    }
+    PB_END();
+}
+
+void make_level_set3_exact(const std::vector<Vec3ui> &tri, const std::vector<Vec3f> &x,
+    const Vec3f &origin, float dx, int ni, int nj, int nk,
+    SDFArray3F &phi)
+{
+    phi.resize(ni, nj, nk);
+    phi.assign((ni+nj+nk)*dx); // upper bound on distance, for an empty mesh
+    if(tri.empty()) return;
+
+    PB_START("Building BVH over %d triangles", (int)tri.size());
+    TriangleBVH bvh(tri, x);
+    PB_END();
+
+    const bool closed=is_closed(tri);
+    exact_slab(bvh, closed, tri, x, origin, dx, 0, phi, NULL, "Computing exact distances and winding numbers");
+}
+
+void make_level_set3_tiled(const std::vector<Vec3ui> &tri, const std::vector<Vec3f> &x,
+    const Vec3f &origin, float dx, int ni, int nj, int nk, int slab_layers, bool winding_signs,
+    const std::function<void(const SDFArray3F &slab, int k_begin)> &write)
+{
+    slab_layers=clamp(slab_layers, 1, nk);
+    const int slabs=(nk+slab_layers-1)/slab_layers;
+
+    PB_START("Building BVH over %d triangles", (int)tri.size());
+    TriangleBVH bvh(tri, x);
+    PB_END();
+    const bool closed=winding_signs && !tri.empty() && is_closed(tri);
+
+    SDFArray3F phi;
+    SDFArray3I intersection_count;
+    for(int k_begin=0, slab=0; k_begin<nk; k_begin+=slab_layers, ++slab){
+        const int layers=std::min(slab_layers, nk-k_begin);
+        phi.resize(ni, nj, layers);
+        if(tri.empty()){
+            phi.assign((ni+nj+nk)*dx); // upper bound on distance
+        }else{
+            if(!winding_signs){
+                intersection_count.resize(ni, nj, layers);
+                intersection_count.assign(0);
+                count_intersections(tri, x, origin, dx, ni, nj, k_begin, intersection_count);
+            }
+            char description[128];
+            snprintf(description, sizeof(description), "Computing slab %d of %d (z %d to %d)", slab+1, slabs, k_begin, k_begin+layers-1);
+            exact_slab(bvh, closed, tri, x, origin, dx, k_begin, phi, winding_signs ? NULL : &intersection_count, description);
+        }
+        write(phi, k_begin);
+    }
+}
@@ -4,6 +4,8 @@
 #include "array3.h"
 #include "vec.h"
 
+#include <functional>
+
 // tri is a list of triangles in the mesh, and x is the positions of the vertices
 // absolute distances will be nearly correct for triangle soup, but a closed mesh is
 // needed for accurate signs. Distances for all grid cells within exact_band cells of
@@ -13,4 +15,21 @@ void make_level_set3(const std::vector<Vec3ui> &tri, const std::vector<Vec3f> &x
                      const Vec3f &origin, float dx, int nx, int ny, int nz,
                      SDFArray3F &phi, const int exact_band=1);
 
+// Exact distances for every grid cell, from a closest-triangle query on a BVH per cell.
+// Signs come from the generalized winding number rather than ray parity, so meshes with
+// holes (e.g. scans) get sensible inside/outside as well.
+void make_level_set3_exact(const std::vector<Vec3ui> &tri, const std::vector<Vec3f> &x,
+                           const Vec3f &origin, float dx, int nx, int ny, int nz,
+                           SDFArray3F &phi);
+
+// Out-of-core make_level_set3_exact: the grid is computed in z-slabs of slab_layers layers,
+// each handed to write along with its first layer and then reused, so only one slab is ever
+// in memory. Every cell is computed on its own, so slabs need no halo and the distances are
+// the same as make_level_set3_exact's. Signs come from winding numbers, or when winding_signs
+// is false from ray parity like make_level_set3; the rays run along x, so each lies inside one slab.
+void make_level_set3_tiled(const std::vector<Vec3ui> &tri, const std::vector<Vec3f> &x,
+                           const Vec3f &origin, float dx, int nx, int ny, int nz,
+                           int slab_layers, bool winding_signs,
+                           const std::function<void(const SDFArray3F &slab, int k_begin)> &write);
+
 #endif
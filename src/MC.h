@@ -3,7 +3,11 @@
 
 #include <mutex>
 #include <vector>
+#include <atomic>
+#include <algorithm>
 #include <cmath>
+#include <unordered_map>
+#include <omp.h>
 
 #include "SETTINGS.h"
 
@@ -46,12 +50,50 @@ namespace MC
     static uint defaultVerticeArraySize  = 100000;
     static uint defaultNormalArraySize   = 100000;
     static uint defaultTriangleArraySize = 400000;
+    static uint defaultNumThreads        = 0;
+
+    enum ROOT_FINDER {
+        BISECTION,  // halve the bracket until the value is within MC_ROOTFINDING_THRESH
+        LINEAR,     // interpolate the two lattice values, no extra evaluations
+        ILLINOIS,   // regula falsi with the Illinois fix for one-sided convergence
+        BRENT       // Brent's method: inverse quadratic / secant steps inside a bisection bracket
+    };
+
+    static ROOT_FINDER rootFinder              = BISECTION;
+    static uint        rootFindingMaxEvaluations = MC_MAX_ROOTFINDING_ITERATIONS;
+    static Real        rootFindingTolerance    = 0; // bracket width in grid units, 0 to only use the value threshold
+
+    // Counters for the current run, reset at the start of each march
+    static std::atomic<uint64_t> rootFindingEdges(0);
+    static std::atomic<uint64_t> rootFindingEvaluations(0);
+
+    // Edge vertices on the bottom plane of a slab are owned by the slab below. Until the
+    // slabs are stitched, their indices hold (plane position * 2 + axis) with this bit set.
+    static const uint mc_internalSeamBit = 0x80000000u;
+
+    struct mc_internalSlab
+    {
+        uint zBegin, zEnd;              // cell layers [zBegin, zEnd)
+        Mesh mesh;                      // vertices and indices local to the slab
+        std::vector<VEC3I> topInds;     // slab_inds plane at zEnd, read by the slab above
+        std::vector<uint64_t> vertexEdges; // grid edge key of each vertex, if asked for
+    };
 
     static inline uint mc_internalToIndex1D(uint i, uint j, uint k, const VEC3I& size)
     {
         return (k * size.y() + j) * size.x() + i;
     }
 
+    static inline uint64_t mc_internalPointKey(uint x, uint y, uint z, uint nx, uint ny)
+    {
+        return ((uint64_t) z * ny + y) * nx + x;
+    }
+
+    static inline uint64_t mc_internalEdgeKey(uint x, uint y, uint z, int axis, uint nx, uint ny)
+    {
+        return mc_internalPointKey(x, y, z, nx, ny) * 3 + axis;
+    }
+
     static inline uint mc_internalToIndex1DSlab(uint i, uint j, uint k, const VEC3I& size)
     {
         return size.x() * size.y() * (k % 2) + j * size.x() + i;
@@ -127,48 +169,166 @@ namespace MC
     };
 
     /*!
-      \brief Approximates the vertex position of the mesh from the scalar values along an edge (va, vb).
-      \param slab_inds slab indices global array
-      \param mesh the mesh
-      \param va, vb edges values
+      \brief Locates the zero crossing on the edge from (x, y, z) along axis, in grid index space.
+      Uses the root finder chosen with setRootFinder, and adds to the run's counters.
+      \param grid the sampled grid
+      \param va value at (x, y, z)
+      \param vb value at the other end of the edge, of the opposite sign
       \param axis axis index 0/1/2
-      \param x, y, z current slab index
-      \param size slab indices array size
+      \param x, y, z lower end of the edge
       */
-    static void mc_internalComputeEdge(VEC3I* slab_inds, Mesh& mesh, Grid3D* grid, float va, float vb, int axis, uint x, uint y, uint z, const VEC3I& size)
+    static inline VEC3F mc_internalFindRoot(Grid3D* grid, float va, float vb, int axis, uint x, uint y, uint z)
     {
-        if ((va < 0.0) == (vb < 0.0))
-            return;
+        VEC3F offset(0,0,0);
+        uint evaluations = 0;
 
+        auto f = [&](double t) {
+            offset[axis] = t;
+            evaluations++;
+            return grid->getf(VEC3F(x, y, z) + offset);
+        };
 
-        VEC3F offset(0,0,0);
+        ROOT_FINDER method = rootFinder;
+        if (!grid->supportsNonIntegerIndices && method != LINEAR) {
+            method = BISECTION; // nothing to search between the lattice values
+        }
+
+        double t = 0;
+        switch (method) {
+        case LINEAR:
+            t = va / (va - vb);
+            break;
+
+        case BISECTION:
+            if (grid->supportsNonIntegerIndices) { // Do a root-finding pass if we can
+                double l_bound = (va<0)?1:0; // l_bound stays on the non-negative end, as classified by march_cubes
+                double r_bound = (va<0)?0:1;
 
-        if (grid->supportsNonIntegerIndices) { // Do a root-finding pass if we can
-            double l_bound = (va>0)?0:1;
-            double r_bound = (va>0)?1:0;
+                for(uint i = 0; i < rootFindingMaxEvaluations; ++i) {
+                    t = 0.5 * (l_bound + r_bound);
+                    const Real val = f(t);
+
+                    if (fabs(val) < MC_ROOTFINDING_THRESH) break;
+
+                    if(val < 0) {
+                        r_bound = t;
+                    } else {
+                        l_bound = t;
+                    }
 
-            for(int i = 0; i < MC_MAX_ROOTFINDING_ITERATIONS; ++i) {
-                offset[axis] = 0.5 * (l_bound + r_bound);
-                VEC3F samplePoint = VEC3F(x,y,z) + offset;
-                const Real val = grid->getf(samplePoint);
+                    if (fabs(r_bound - l_bound) < rootFindingTolerance) break;
+                }
+            }
+            break;
 
-                if (fabs(val) < MC_ROOTFINDING_THRESH) break;
+        case ILLINOIS: {
+            // Regula falsi, halving the stale end's value when the same end is kept twice
+            double a = 0, b = 1;
+            double fa = va, fb = vb;
+            int side = 0;
+            t = fa / (fa - fb); // kept if no evaluations are allowed
+            for (uint i = 0; i < rootFindingMaxEvaluations; ++i) {
+                t = (a * fb - b * fa) / (fb - fa);
+                const double ft = f(t);
+                if (fabs(ft) < MC_ROOTFINDING_THRESH) break;
 
-                if(val < 0) {
-                    r_bound = offset[axis];
+                if ((ft < 0) == (fb < 0)) {
+                    b = t; fb = ft;
+                    if (side == -1) fa *= 0.5;
+                    side = -1;
                 } else {
-                    l_bound = offset[axis];
+                    a = t; fa = ft;
+                    if (side == 1) fb *= 0.5;
+                    side = 1;
                 }
+
+                if (b - a < rootFindingTolerance) break;
             }
+            break;
+        }
 
+        case BRENT: {
+            // Brent's method (zeroin) on t in [0, 1]
+            double a = 0, b = 1, c = 1, d = 1, e = 1;
+            double fa = va, fb = vb, fc = vb;
+            for (uint i = 0; i < rootFindingMaxEvaluations; ++i) {
+                if ((fb < 0) == (fc < 0)) {
+                    c = a; fc = fa;
+                    d = e = b - a;
+                }
+                if (fabs(fc) < fabs(fb)) {
+                    a = b; b = c; c = a;
+                    fa = fb; fb = fc; fc = fa;
+                }
+
+                const double tol = 0.5 * rootFindingTolerance + 1e-15;
+                const double m = 0.5 * (c - b);
+                if (fabs(m) <= tol || fabs(fb) < MC_ROOTFINDING_THRESH) break;
+
+                if (fabs(e) >= tol && fabs(fa) > fabs(fb)) {
+                    double p, q;
+                    const double s = fb / fa;
+                    if (a == c) {
+                        p = 2 * m * s;
+                        q = 1 - s;
+                    } else {
+                        const double r = fb / fc;
+                        q = fa / fc;
+                        p = s * (2 * m * q * (q - r) - (b - a) * (r - 1));
+                        q = (q - 1) * (r - 1) * (s - 1);
+                    }
+                    if (p > 0) q = -q; else p = -p;
+
+                    if (2 * p < std::min(3 * m * q - fabs(tol * q), fabs(e * q))) {
+                        e = d;
+                        d = p / q;
+                    } else {
+                        d = e = m;
+                    }
+                } else {
+                    d = e = m;
+                }
+
+                a = b; fa = fb;
+                b += (fabs(d) > tol) ? d : (m > 0 ? tol : -tol);
+                fb = f(b);
+            }
+            t = evaluations ? b : va / (va - vb);
+            break;
         }
+        }
+
+        offset[axis] = t;
+        rootFindingEdges.fetch_add(1, std::memory_order_relaxed);
+        rootFindingEvaluations.fetch_add(evaluations, std::memory_order_relaxed);
 
+        return VEC3F(x, y, z) + offset;
+    }
+
+    /*!
+      \brief Approximates the vertex position of the mesh from the scalar values along an edge (va, vb).
+      \param slab_inds slab indices global array
+      \param mesh the mesh
+      \param va, vb edges values
+      \param axis axis index 0/1/2
+      \param x, y, z current slab index
+      \param size slab indices array size
+      \param origin grid index of the window's first corner; vertices are placed in grid index space
+      \param vertexEdges if not NULL, receives the grid edge key of the vertex
+      */
+    static void mc_internalComputeEdge(VEC3I* slab_inds, Mesh& mesh, Grid3D* grid, float va, float vb, int axis, uint x, uint y, uint z, const VEC3I& size, const VEC3I& origin,
+                                       std::vector<uint64_t>* vertexEdges)
+    {
+        if ((va < 0.0) == (vb < 0.0))
+            return;
 
-        VEC3F v = VEC3F(x, y, z) + offset;
+        VEC3F v = mc_internalFindRoot(grid, va, vb, axis, x + origin.x(), y + origin.y(), z + origin.z());
         // v[axis] += va / (va - vb);
         slab_inds[mc_internalToIndex1DSlab(x, y, z, size)][axis] = uint(mesh.vertices.size());
         mesh.vertices.push_back(v);
         mesh.normals.push_back(VEC3F(0, 0, 0));
+        if (vertexEdges)
+            vertexEdges->push_back(mc_internalEdgeKey(x + origin.x(), y + origin.y(), z + origin.z(), axis, grid->xRes, grid->yRes));
     }
 
     /*!
@@ -204,34 +364,122 @@ namespace MC
         defaultTriangleArraySize	= triSize;
     }
 
+    /*
+       \brief Sets the number of threads march_cubes splits the z-slabs across.
+       \param numThreads thread count, or 0 to use every available core
+       */
+    inline void setNumThreads(uint numThreads)
+    {
+        defaultNumThreads = numThreads;
+    }
+
+    /*
+       \brief Selects how edge vertices are placed between two lattice values of opposite sign.
+       \param method root finder
+       \param maxEvaluations cap on grid evaluations per edge
+       \param tolerance stop once the root is bracketed this tightly, in grid units (0 to disable)
+       */
+    inline void setRootFinder(ROOT_FINDER method, uint maxEvaluations = MC_MAX_ROOTFINDING_ITERATIONS, Real tolerance = 0)
+    {
+        rootFinder                = method;
+        rootFindingMaxEvaluations = maxEvaluations;
+        rootFindingTolerance      = tolerance;
+    }
+
+    inline const char* rootFinderName(ROOT_FINDER method)
+    {
+        switch (method) {
+        case BISECTION: return "bisection";
+        case LINEAR:    return "linear";
+        case ILLINOIS:  return "illinois";
+        case BRENT:     return "brent";
+        }
+        return "unknown";
+    }
+
+    static inline void mc_internalResetRootFindingStats()
+    {
+        rootFindingEdges = 0;
+        rootFindingEvaluations = 0;
+    }
+
+    static inline void mc_internalPrintRootFindingStats()
+    {
+        printf("Root finding (%s): %llu edges, %.2f evaluations per edge\n", rootFinderName(rootFinder),
+            (unsigned long long) rootFindingEdges, rootFindingEdges ? (double) rootFindingEvaluations / rootFindingEdges : 0.0);
+    }
+
     /*!
-      \brief Computes the mesh representing the zero isosurface of a 3D scalar field and
-      outputs it to an indexed mesh.
-      \param grid Grid3D scalar field or function of real values
-      \param outputMesh indexed mesh returned.
-      \param verbose if true, prints progress updates
+      \brief Places the vertex of one crossed lattice edge with the current root finder, the
+      way the marchers do, e.g. to calibrate a cost model. Not safe to call while marching.
+      \param grid the sampled grid
+      \param x, y, z lower end of the edge
+      \param axis axis index 0/1/2
+      \return the number of grid evaluations the root finder made
       */
-    inline void march_cubes(Grid3D *grid, Mesh& outputMesh, bool verbose = false) {
+    inline uint rootFindingEvaluationsOnEdge(Grid3D* grid, uint x, uint y, uint z, int axis)
+    {
+        VEC3F upper(x, y, z);
+        upper[axis] += 1;
+        const uint64_t before = rootFindingEvaluations;
+        mc_internalFindRoot(grid, grid->getf(VEC3F(x, y, z)), grid->getf(upper), axis, x, y, z);
 
-        uint nx = grid->xRes;
-        uint ny = grid->yRes;
-        uint nz = grid->zRes;
+        const uint evaluations = rootFindingEvaluations - before;
+        rootFindingEdges--;
+        rootFindingEvaluations -= evaluations;
+        return evaluations;
+    }
 
-        outputMesh.vertices.reserve(defaultVerticeArraySize);
-        outputMesh.normals.reserve(defaultNormalArraySize);
-        outputMesh.indices.reserve(defaultTriangleArraySize);
+    /*!
+      \brief Fills one XY plane of corner values for a slab.
+      \param grid the sampled grid
+      \param plane output array of size.x() * size.y() values
+      \param z plane index within the window
+      \param size, origin window extent and first corner, in grid indices
+      */
+    static inline void mc_internalSamplePlane(Grid3D* grid, Real* plane, uint z, const VEC3I& size, const VEC3I& origin)
+    {
+        const uint nx = size.x();
+        const uint ny = size.y();
+        for (uint y = 0; y < ny; y++)
+            grid->getRowSpan(origin.x(), nx, origin.y() + y, origin.z() + z, plane + y * nx);
+    }
 
-        PB_START("Marching cubes with res %dx%dx%d", nx, ny, nz);
-        PB_PROGRESS(0);
+    /*!
+      \brief Marches the cell layers [slab.zBegin, slab.zEnd) into the slab's local mesh.
+      The x and y edge vertices on the bottom plane of a slab (other than the first) are
+      created by the slab below, so they are recorded as seam placeholders here and
+      resolved when the slabs are merged.
+      \param grid the sampled grid
+      \param size, origin window extent and first corner, in grid indices
+      \param slab slab range and output buffers
+      \param slab_inds slab indices array of size nx * ny * 2
+      \param planeVals corner value array of size nx * ny * 2
+      \param progress count of finished cell layers, shared between slabs
+      \param keepEdges if true, records the grid edge key of each vertex in slab.vertexEdges
+      */
+    static void mc_internalMarchSlab(Grid3D* grid, const VEC3I& size, const VEC3I& origin, mc_internalSlab& slab, VEC3I* slab_inds, Real* planeVals, std::atomic<uint>& progress,
+                                     bool keepEdges = false)
+    {
+        const uint nx = size.x();
+        const uint ny = size.y();
+        Mesh& mesh = slab.mesh;
+        std::vector<uint64_t>* vertexEdges = keepEdges ? &slab.vertexEdges : NULL;
 
-        VEC3I* slab_inds = new VEC3I[nx * ny * 2];
-        for (uint i = 0; i < nx*ny*2; ++i) {
-            slab_inds[i] = VEC3I(0,0,0);
+        if (slab.zBegin > 0) {
+            for (uint y = 0; y < ny; y++) {
+                for (uint x = 0; x < nx; x++) {
+                    const uint seam = mc_internalSeamBit | ((y * nx + x) * 2);
+                    slab_inds[mc_internalToIndex1DSlab(x, y, slab.zBegin, size)] = VEC3I(seam, seam + 1, 0);
+                }
+            }
         }
 
-        for (uint z = 0; z < nz - 1; z++)
+        mc_internalSamplePlane(grid, planeVals + nx * ny * (slab.zBegin % 2), slab.zBegin, size, origin);
+
+        for (uint z = slab.zBegin; z < slab.zEnd; z++)
         {
-            const VEC3I size(nx, ny, nz);
+            mc_internalSamplePlane(grid, planeVals + nx * ny * ((z + 1) % 2), z + 1, size, origin);
 
             Real vs[8] = { 0, 0, 0, 0, 0, 0, 0, 0 };
             uint edge_indices[12];
@@ -241,14 +489,14 @@ namespace MC
                 for (uint x = 0; x < nx - 1; x++)
                 {
 
-                    vs[0] = grid->get(x, y, z);
-                    vs[1] = grid->get(x + 1, y, z);
-                    vs[2] = grid->get(x, y + 1, z);
-                    vs[3] = grid->get(x + 1, y + 1, z);
-                    vs[4] = grid->get(x, y, z + 1);
-                    vs[5] = grid->get(x + 1, y, z + 1);
-                    vs[6] = grid->get(x, y + 1, z + 1);
-                    vs[7] = grid->get(x + 1, y + 1, z + 1);
+                    vs[0] = planeVals[mc_internalToIndex1DSlab(x, y, z, size)];
+                    vs[1] = planeVals[mc_internalToIndex1DSlab(x + 1, y, z, size)];
+                    vs[2] = planeVals[mc_internalToIndex1DSlab(x, y + 1, z, size)];
+                    vs[3] = planeVals[mc_internalToIndex1DSlab(x + 1, y + 1, z, size)];
+                    vs[4] = planeVals[mc_internalToIndex1DSlab(x, y, z + 1, size)];
+                    vs[5] = planeVals[mc_internalToIndex1DSlab(x + 1, y, z + 1, size)];
+                    vs[6] = planeVals[mc_internalToIndex1DSlab(x, y + 1, z + 1, size)];
+                    vs[7] = planeVals[mc_internalToIndex1DSlab(x + 1, y + 1, z + 1, size)];
 
                     const int config_n =
                         ((vs[0] < 0) << 0) |
@@ -263,31 +511,31 @@ namespace MC
                         continue;
 
                     if (y == 0 && z == 0)
-                        mc_internalComputeEdge(slab_inds, outputMesh, grid, vs[0], vs[1], 0, x, y, z, size);
+                        mc_internalComputeEdge(slab_inds, mesh, grid, vs[0], vs[1], 0, x, y, z, size, origin, vertexEdges);
                     if (z == 0)
-                        mc_internalComputeEdge(slab_inds, outputMesh, grid, vs[2], vs[3], 0, x, y + 1, z, size);
+                        mc_internalComputeEdge(slab_inds, mesh, grid, vs[2], vs[3], 0, x, y + 1, z, size, origin, vertexEdges);
                     if (y == 0)
-                        mc_internalComputeEdge(slab_inds, outputMesh, grid, vs[4], vs[5], 0, x, y, z + 1, size);
+                        mc_internalComputeEdge(slab_inds, mesh, grid, vs[4], vs[5], 0, x, y, z + 1, size, origin, vertexEdges);
 
-                    mc_internalComputeEdge(slab_inds, outputMesh, grid, vs[6], vs[7], 0, x, y + 1, z + 1, size);
+                    mc_internalComputeEdge(slab_inds, mesh, grid, vs[6], vs[7], 0, x, y + 1, z + 1, size, origin, vertexEdges);
 
                     if (x == 0 && z == 0)
-                        mc_internalComputeEdge(slab_inds, outputMesh, grid, vs[0], vs[2], 1, x, y, z, size);
+                        mc_internalComputeEdge(slab_inds, mesh, grid, vs[0], vs[2], 1, x, y, z, size, origin, vertexEdges);
                     if (z == 0)
-                        mc_internalComputeEdge(slab_inds, outputMesh, grid, vs[1], vs[3], 1,x + 1, y, z, size);
+                        mc_internalComputeEdge(slab_inds, mesh, grid, vs[1], vs[3], 1,x + 1, y, z, size, origin, vertexEdges);
                     if (x == 0)
-                        mc_internalComputeEdge(slab_inds, outputMesh, grid, vs[4], vs[6], 1, x, y, z + 1, size);
+                        mc_internalComputeEdge(slab_inds, mesh, grid, vs[4], vs[6], 1, x, y, z + 1, size, origin, vertexEdges);
 
-                    mc_internalComputeEdge(slab_inds, outputMesh, grid, vs[5], vs[7], 1, x + 1, y, z + 1, size);
+                    mc_internalComputeEdge(slab_inds, mesh, grid, vs[5], vs[7], 1, x + 1, y, z + 1, size, origin, vertexEdges);
 
                     if (x == 0 && y == 0)
-                        mc_internalComputeEdge(slab_inds, outputMesh, grid, vs[0], vs[4], 2, x, y, z, size);
+                        mc_internalComputeEdge(slab_inds, mesh, grid, vs[0], vs[4], 2, x, y, z, size, origin, vertexEdges);
                     if (y == 0)
-                        mc_internalComputeEdge(slab_inds, outputMesh, grid, vs[1], vs[5], 2, x + 1, y, z, size);
+                        mc_internalComputeEdge(slab_inds, mesh, grid, vs[1], vs[5], 2, x + 1, y, z, size, origin, vertexEdges);
                     if (x == 0)
-                        mc_internalComputeEdge(slab_inds, outputMesh, grid, vs[2], vs[6], 2, x, y + 1, z, size);
+                        mc_internalComputeEdge(slab_inds, mesh, grid, vs[2], vs[6], 2, x, y + 1, z, size, origin, vertexEdges);
 
-                    mc_internalComputeEdge(slab_inds, outputMesh, grid, vs[3], vs[7], 2, x + 1, y + 1, z, size);
+                    mc_internalComputeEdge(slab_inds, mesh, grid, vs[3], vs[7], 2, x + 1, y + 1, z, size, origin, vertexEdges);
 
                     edge_indices[0] = slab_inds[mc_internalToIndex1DSlab(x, y, z, size)].x();
                     edge_indices[1] = slab_inds[mc_internalToIndex1DSlab(x, y + 1, z, size)].x();
@@ -305,39 +553,911 @@ namespace MC
                     const uint64_t& config = mc_internalMarching_cube_tris[config_n];
                     const size_t n_triangles = config & 0xF;
                     const size_t n_indices = n_triangles * 3;
-                    const size_t& indexBase = outputMesh.indices.size();
                     int offset = 4;
                     for (size_t i = 0; i < n_indices; i++)
                     {
                         const int edge = (config >> offset) & 0xF;
-                        outputMesh.indices.push_back(edge_indices[edge]);
+                        mesh.indices.push_back(edge_indices[edge]);
                         offset += 4;
                     }
-                    for (size_t i = 0; i < n_triangles; i++)
+
+                }
+            }
+
+            progress++;
+        }
+
+        const VEC3I* top = slab_inds + nx * ny * (slab.zEnd % 2);
+        slab.topInds.assign(top, top + nx * ny);
+    }
+
+    /*!
+      \brief Computes the mesh representing the zero isosurface of a 3D scalar field and
+      outputs it to an indexed mesh.
+
+      The z range is split into slabs which are claimed by threads as they free up. Each
+      slab keeps its own vertex/index buffers and corner planes; slabs are then stitched
+      in order through their shared boundary planes, so the result is identical to a
+      single-threaded march regardless of the thread count. With more than one thread,
+      the grid must support concurrent get()/getf() calls. Called from inside a parallel
+      region (e.g. for one tile of march_cubes_tiled), it runs on the calling thread alone
+      and quietly, adding to the enclosing run's root-finding counters.
+
+      Only the cells within [windowMin, windowMax] (inclusive lattice indices) are marched, but
+      vertices are found and placed in the grid's own index space, so neighbouring windows
+      produce bitwise identical vertices on the plane they share.
+      \param grid Grid3D scalar field or function of real values
+      \param windowMin, windowMax lattice window to march
+      \param outputMesh indexed mesh returned.
+      \param verbose if true, prints progress updates
+      \param vertexEdges if not NULL, receives the grid edge key (see mc_internalEdgeKey) of
+      each vertex added, which neighbouring windows agree on
+      */
+    inline void march_cubes_window(Grid3D *grid, const VEC3I& windowMin, const VEC3I& windowMax, Mesh& outputMesh, bool verbose = false,
+                                   std::vector<uint64_t>* vertexEdges = NULL) {
+
+        uint nx = windowMax.x() - windowMin.x() + 1;
+        uint ny = windowMax.y() - windowMin.y() + 1;
+        uint nz = windowMax.z() - windowMin.z() + 1;
+        const VEC3I size(nx, ny, nz);
+
+        const bool nested = omp_get_level() > 0;
+
+        if (!nested) {
+            outputMesh.vertices.reserve(defaultVerticeArraySize);
+            outputMesh.normals.reserve(defaultNormalArraySize);
+            outputMesh.indices.reserve(defaultTriangleArraySize);
+        }
+
+        int numThreads = (defaultNumThreads == 0) ? omp_get_max_threads() : defaultNumThreads;
+        if (!grid->supportsConcurrentQueries() || nested) numThreads = 1;
+
+        // A few slabs per thread keeps the load balanced when surface density varies with z,
+        // but every slab boundary samples its plane twice, so slabs are kept reasonably thick.
+        const uint numLayers = nz - 1;
+        const uint minSlabLayers = 8;
+        uint numSlabs = (numThreads == 1) ? 1 : std::min<uint>(numThreads * 4, std::max<uint>(1, numLayers / minSlabLayers));
+        numSlabs = std::max<uint>(1, std::min(numSlabs, numLayers));
+
+        std::vector<mc_internalSlab> slabs(numSlabs);
+        for (uint s = 0; s < numSlabs; s++) {
+            slabs[s].zBegin = (uint64_t) numLayers * s / numSlabs;
+            slabs[s].zEnd   = (uint64_t) numLayers * (s + 1) / numSlabs;
+        }
+
+        PB_DECL();
+        if (!nested) {
+            PB_STARTD("Marching cubes with res %dx%dx%d on %d thread(s)", nx, ny, nz, numThreads);
+            mc_internalResetRootFindingStats();
+        }
+
+        std::atomic<uint> progress(0);
+
+        #pragma omp parallel num_threads(numThreads)
+        {
+            VEC3I* slab_inds = new VEC3I[nx * ny * 2];
+            Real* planeVals  = new Real[nx * ny * 2];
+            for (uint i = 0; i < nx*ny*2; ++i) {
+                slab_inds[i] = VEC3I(0,0,0);
+            }
+
+            #pragma omp for schedule(dynamic, 1)
+            for (uint s = 0; s < numSlabs; s++) {
+                mc_internalMarchSlab(grid, size, windowMin, slabs[s], slab_inds, planeVals, progress, vertexEdges != NULL);
+
+                if (!nested && omp_get_thread_num() == 0) {
+                    PB_PROGRESS((float) progress / nz);
+                    fflush(stdout);
+                }
+            }
+
+            delete[] slab_inds;
+            delete[] planeVals;
+        }
+
+        // Stitch the slabs together in z order
+        const size_t firstIndex = outputMesh.indices.size();
+        size_t totalVertices = outputMesh.vertices.size();
+        size_t totalIndices  = outputMesh.indices.size();
+        std::vector<size_t> vertexOffsets(numSlabs);
+        for (uint s = 0; s < numSlabs; s++) {
+            vertexOffsets[s] = totalVertices;
+            totalVertices += slabs[s].mesh.vertices.size();
+            totalIndices  += slabs[s].mesh.indices.size();
+        }
+        outputMesh.vertices.reserve(totalVertices);
+        outputMesh.indices.reserve(totalIndices);
+
+        for (uint s = 0; s < numSlabs; s++) {
+            Mesh& slabMesh = slabs[s].mesh;
+            outputMesh.vertices.insert(outputMesh.vertices.end(), slabMesh.vertices.begin(), slabMesh.vertices.end());
+            if (vertexEdges)
+                vertexEdges->insert(vertexEdges->end(), slabs[s].vertexEdges.begin(), slabs[s].vertexEdges.end());
+
+            for (uint index : slabMesh.indices) {
+                if (index & mc_internalSeamBit) {
+                    const uint seam = index & ~mc_internalSeamBit;
+                    const VEC3I& below = slabs[s - 1].topInds[seam / 2];
+                    outputMesh.indices.push_back(vertexOffsets[s - 1] + (seam % 2 == 0 ? below.x() : below.y()));
+                } else {
+                    outputMesh.indices.push_back(vertexOffsets[s] + index);
+                }
+            }
+
+            slabMesh = Mesh();
+            slabs[s].vertexEdges = std::vector<uint64_t>();
+            if (s > 0) slabs[s - 1].topInds = std::vector<VEC3I>();
+        }
+
+        outputMesh.normals.resize(outputMesh.vertices.size(), VEC3F(0, 0, 0));
+        for (size_t i = firstIndex; i < totalIndices; i += 3)
+        {
+            mc_internalAccumulateNormal(outputMesh,
+                outputMesh.indices[i + 0],
+                outputMesh.indices[i + 1],
+                outputMesh.indices[i + 2]);
+        }
+
+        if (!nested) {
+            PB_END();
+        }
+
+        if (verbose && !nested) {
+            printf("\n");
+            mc_internalPrintRootFindingStats();
+        }
+
+        for (size_t i = 0; i < outputMesh.normals.size(); i++)
+            outputMesh.normals[i] = mc_internalNormalize(outputMesh.normals[i]);
+
+    }
+
+    /*!
+      \brief Computes the mesh representing the zero isosurface of a 3D scalar field and
+      outputs it to an indexed mesh. See march_cubes_window, which this runs over the whole grid.
+      \param grid Grid3D scalar field or function of real values
+      \param outputMesh indexed mesh returned.
+      \param verbose if true, prints progress updates
+      */
+    inline void march_cubes(Grid3D *grid, Mesh& outputMesh, bool verbose = false) {
+        march_cubes_window(grid, VEC3I(0, 0, 0), VEC3I(grid->xRes - 1, grid->yRes - 1, grid->zRes - 1), outputMesh, verbose);
+    }
+
+    /*!
+      \brief Marches the whole grid in thin slabs, a round of them in parallel, and hands each
+      slab's vertices and triangles to the sink as soon as they are final, so only a few slabs
+      of mesh are in memory at a time. A slab's vertices are final once the slab above has
+      added its triangles to their normals. The stream matches what march_cubes produces.
+      \param grid Grid3D scalar field or function of real values
+      \param sink receives the mesh; it is not closed
+      \param toFieldCoords if true, vertices are mapped through grid->gridToFieldCoords
+      \param verbose if true, prints progress updates
+      \param slabLayers cell layers per slab
+      */
+    inline void march_cubes_stream(Grid3D *grid, MeshSink& sink, bool toFieldCoords = false, bool verbose = false, uint slabLayers = 8) {
+        const VEC3I size(grid->xRes, grid->yRes, grid->zRes);
+        const uint nx = size.x(), ny = size.y();
+
+        int numThreads = (defaultNumThreads == 0) ? omp_get_max_threads() : defaultNumThreads;
+        if (!grid->supportsConcurrentQueries()) numThreads = 1;
+
+        const uint numLayers = size.z() - 1;
+        const uint numSlabs = std::max<uint>(1, (numLayers + slabLayers - 1) / slabLayers);
+        std::vector<mc_internalSlab> slabs(numSlabs);
+        for (uint s = 0; s < numSlabs; s++) {
+            slabs[s].zBegin = std::min(numLayers, s * slabLayers);
+            slabs[s].zEnd   = std::min(numLayers, (s + 1) * slabLayers);
+        }
+
+        PB_DECL();
+        PB_STARTD("Streaming marching cubes with res %dx%dx%d on %d thread(s)", nx, ny, size.z(), numThreads);
+        mc_internalResetRootFindingStats();
+        std::atomic<uint> progress(0);
+
+        // Vertices from pendingBase on, with their normal sums, and the triangles of the last
+        // stitched slab, which may still use them
+        Mesh pending;
+        size_t pendingBase = 0;
+        std::vector<size_t> vertexOffsets(numSlabs);
+
+        auto emitVertices = [&](size_t count) {
+            for (size_t i = 0; i < count; i++) {
+                pending.normals[i] = mc_internalNormalize(pending.normals[i]);
+                if (toFieldCoords) pending.vertices[i] = grid->gridToFieldCoords(pending.vertices[i]);
+            }
+            sink.addVertices(pending.vertices.data(), pending.normals.data(), count);
+            pending.vertices.erase(pending.vertices.begin(), pending.vertices.begin() + count);
+            pending.normals.erase(pending.normals.begin(), pending.normals.begin() + count);
+            pendingBase += count;
+        };
+
+        for (uint round = 0; round < numSlabs; round += numThreads) {
+            const uint roundEnd = std::min<uint>(numSlabs, round + numThreads);
+
+            #pragma omp parallel num_threads(numThreads)
+            {
+                VEC3I* slab_inds = new VEC3I[nx * ny * 2];
+                Real* planeVals  = new Real[nx * ny * 2];
+                for (uint i = 0; i < nx*ny*2; ++i) {
+                    slab_inds[i] = VEC3I(0,0,0);
+                }
+
+                #pragma omp for schedule(dynamic, 1)
+                for (uint s = round; s < roundEnd; s++) {
+                    mc_internalMarchSlab(grid, size, VEC3I(0, 0, 0), slabs[s], slab_inds, planeVals, progress);
+                }
+
+                delete[] slab_inds;
+                delete[] planeVals;
+            }
+
+            for (uint s = round; s < roundEnd; s++) {
+                Mesh& slabMesh = slabs[s].mesh;
+                vertexOffsets[s] = pendingBase + pending.vertices.size();
+                pending.vertices.insert(pending.vertices.end(), slabMesh.vertices.begin(), slabMesh.vertices.end());
+                pending.normals.resize(pending.vertices.size(), VEC3F(0, 0, 0));
+
+                // The previous slab's triangles only use vertices up to this slab's
+                const size_t previousTriangles = pending.indices.size();
+                for (uint index : slabMesh.indices) {
+                    if (index & mc_internalSeamBit) {
+                        const uint seam = index & ~mc_internalSeamBit;
+                        const VEC3I& below = slabs[s - 1].topInds[seam / 2];
+                        pending.indices.push_back(vertexOffsets[s - 1] + (seam % 2 == 0 ? below.x() : below.y()));
+                    } else {
+                        pending.indices.push_back(vertexOffsets[s] + index);
+                    }
+                }
+                for (size_t i = previousTriangles; i < pending.indices.size(); i += 3) {
+                    mc_internalAccumulateNormal(pending,
+                        pending.indices[i + 0] - pendingBase,
+                        pending.indices[i + 1] - pendingBase,
+                        pending.indices[i + 2] - pendingBase);
+                }
+
+                slabMesh = Mesh();
+                if (s > 0) {
+                    slabs[s - 1].topInds = std::vector<VEC3I>();
+
+                    // Everything below this slab is final
+                    emitVertices(vertexOffsets[s] - pendingBase);
+                    sink.addTriangles(pending.indices.data(), previousTriangles / 3);
+                    pending.indices.erase(pending.indices.begin(), pending.indices.begin() + previousTriangles);
+                }
+            }
+
+            PB_PROGRESS((float) progress / size.z());
+            fflush(stdout);
+        }
+
+        emitVertices(pending.vertices.size());
+        sink.addTriangles(pending.indices.data(), pending.indices.size() / 3);
+
+        PB_END();
+        if (verbose) {
+            printf("\n");
+            mc_internalPrintRootFindingStats();
+        }
+    }
+
+    // Cube edges as (corner at the lower end, lower end offset, axis), matching edge_indices
+    // in mc_internalMarchSlab
+    static const int mc_internalEdgeCorner[12] = { 0, 2, 4, 6, 0, 1, 4, 5, 0, 1, 2, 3 };
+    static const int mc_internalEdgeAxis[12]   = { 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2 };
+    static const int mc_internalEdgeOffset[12][3] = {
+        {0,0,0}, {0,1,0}, {0,0,1}, {0,1,1},
+        {0,0,0}, {1,0,0}, {0,0,1}, {1,0,1},
+        {0,0,0}, {1,0,0}, {0,1,0}, {1,1,0}
+    };
+
+    struct mc_internalEdge
+    {
+        uint64_t key;   // mc_internalEdgeKey of the edge
+        Real va, vb;    // values at its lower and upper ends
+
+        bool operator<(const mc_internalEdge& other) const { return key < other.key; }
+        bool operator==(const mc_internalEdge& other) const { return key == other.key; }
+    };
+
+    struct mc_internalBrick
+    {
+        uint64_t id;                                    // (bz * nby + by) * nbx + bx
+        std::vector<uint64_t> triEdges;                 // 3 global edge keys per triangle
+        std::vector<mc_internalEdge> edges;             // crossed edges
+        uint faceMask;                                  // bit f set if face f (-x,+x,-y,+y,-z,+z) changes sign
+        std::vector<Real> faces[6];                     // lattice values on face f, for the neighbours
+    };
+
+    // Index of lattice point (i, j, k) of an sx * sy * sz brick within its face f, which is
+    // laid out over the two other axes in x, y, z order
+    static inline size_t mc_internalFaceIndex(int f, uint i, uint j, uint k, uint sx, uint sy)
+    {
+        switch (f / 2) {
+        case 0:  return (size_t) k * sy + j;
+        case 1:  return (size_t) k * sx + i;
+        default: return (size_t) j * sx + i;
+        }
+    }
+
+    /*!
+      \brief Samples the grid at integer lattice positions, in batches spread over threads.
+      */
+    static void mc_internalSampleLattice(Grid3D* grid, const std::vector<VEC3F>& indices, std::vector<Real>& values, int numThreads)
+    {
+        const size_t batch = 256;
+        values.resize(indices.size());
+
+        #pragma omp parallel for schedule(dynamic, 1) num_threads(numThreads)
+        for (size_t i = 0; i < indices.size(); i += batch) {
+            const size_t n = std::min(batch, indices.size() - i);
+            if (grid->supportsNonIntegerIndices) {
+                grid->getfValues(&indices[i], &values[i], n);
+            } else {
+                for (size_t j = i; j < i + n; j++)
+                    values[j] = grid->get(indices[j].cast<int>());
+            }
+        }
+    }
+
+    /*!
+      \brief Samples one brick of cells and records its triangles against global edge keys.
+      \param grid the sampled grid
+      \param bx, by, bz brick coordinates
+      \param brickSize cells per brick edge
+      \param brick output
+      \param values scratch buffer
+      \param shared for each face f, the values a marched neighbour holds for it, or NULL
+      \return the number of lattice points sampled
+      */
+    static size_t mc_internalMarchBrick(Grid3D* grid, uint bx, uint by, uint bz, uint brickSize, mc_internalBrick& brick, std::vector<Real>& values,
+                                        const std::vector<Real>* shared[6])
+    {
+        const uint nx = grid->xRes;
+        const uint ny = grid->yRes;
+        const uint x0 = bx * brickSize, y0 = by * brickSize, z0 = bz * brickSize;
+        const uint sx = std::min(x0 + brickSize, nx - 1) - x0 + 1;
+        const uint sy = std::min(y0 + brickSize, ny - 1) - y0 + 1;
+        const uint sz = std::min(z0 + brickSize, grid->zRes - 1) - z0 + 1;
+
+        auto at = [&](uint i, uint j, uint k) -> Real& { return values[(k * sy + j) * sx + i]; };
+        auto val = [&](uint i, uint j, uint k) { return values[(k * sy + j) * sx + i]; };
+
+        // Sampled by rows, so the values match march_cubes bit for bit. Faces a neighbour
+        // already sampled are copied from it, and the rest of each row sampled as one span.
+        values.resize(sx * sy * sz);
+        size_t sampled = 0;
+        for (uint k = 0; k < sz; k++) {
+            for (uint j = 0; j < sy; j++) {
+                const int rowFace = (shared[2] && j == 0) ? 2 : (shared[3] && j == sy - 1) ? 3 :
+                                    (shared[4] && k == 0) ? 4 : (shared[5] && k == sz - 1) ? 5 : -1;
+                if (rowFace >= 0) {
+                    for (uint i = 0; i < sx; i++)
+                        at(i, j, k) = (*shared[rowFace])[mc_internalFaceIndex(rowFace, i, j, k, sx, sy)];
+                    continue;
+                }
+
+                const uint first = shared[0] ? 1 : 0;
+                const uint last = shared[1] ? sx - 2 : sx - 1;
+                if (shared[0]) at(0, j, k) = (*shared[0])[mc_internalFaceIndex(0, 0, j, k, sx, sy)];
+                if (shared[1]) at(sx - 1, j, k) = (*shared[1])[mc_internalFaceIndex(1, sx - 1, j, k, sx, sy)];
+                if (first <= last && last < sx) {
+                    grid->getRowSpan(x0 + first, last - first + 1, y0 + j, z0 + k, &at(first, j, k));
+                    sampled += last - first + 1;
+                }
+            }
+        }
+
+        // Keep the faces for the neighbours still to be marched
+        const uint faceDims[3][2] = { { sy, sz }, { sx, sz }, { sx, sy } };
+        for (int f = 0; f < 6; f++) {
+            brick.faces[f].resize((size_t) faceDims[f / 2][0] * faceDims[f / 2][1]);
+            const uint plane = (f % 2 == 0) ? 0 : (f / 2 == 0 ? sx : f / 2 == 1 ? sy : sz) - 1;
+            for (uint v = 0; v < faceDims[f / 2][1]; v++) {
+                for (uint u = 0; u < faceDims[f / 2][0]; u++) {
+                    const uint i = (f / 2 == 0) ? plane : u;
+                    const uint j = (f / 2 == 0) ? u : (f / 2 == 1) ? plane : v;
+                    const uint k = (f / 2 == 2) ? plane : v;
+                    brick.faces[f][mc_internalFaceIndex(f, i, j, k, sx, sy)] = val(i, j, k);
+                }
+            }
+        }
+
+        // Faces where the sign changes let the surface through to the neighbouring brick
+        bool faceNeg[6] = { false }, facePos[6] = { false };
+        for (uint k = 0; k < sz; k++) {
+            for (uint j = 0; j < sy; j++) {
+                for (uint i = 0; i < sx; i++) {
+                    if (i != 0 && i != sx - 1 && j != 0 && j != sy - 1 && k != 0 && k != sz - 1)
+                        continue;
+                    const bool neg = val(i, j, k) < 0;
+                    const bool onFace[6] = { i == 0, i == sx - 1, j == 0, j == sy - 1, k == 0, k == sz - 1 };
+                    for (int f = 0; f < 6; f++) {
+                        if (!onFace[f]) continue;
+                        faceNeg[f] |= neg;
+                        facePos[f] |= !neg;
+                    }
+                }
+            }
+        }
+        brick.faceMask = 0;
+        for (int f = 0; f < 6; f++)
+            if (faceNeg[f] && facePos[f]) brick.faceMask |= 1u << f;
+
+        Real vs[8];
+        for (uint k = 0; k + 1 < sz; k++) {
+            for (uint j = 0; j + 1 < sy; j++) {
+                for (uint i = 0; i + 1 < sx; i++) {
+                    vs[0] = val(i, j, k);
+                    vs[1] = val(i + 1, j, k);
+                    vs[2] = val(i, j + 1, k);
+                    vs[3] = val(i + 1, j + 1, k);
+                    vs[4] = val(i, j, k + 1);
+                    vs[5] = val(i + 1, j, k + 1);
+                    vs[6] = val(i, j + 1, k + 1);
+                    vs[7] = val(i + 1, j + 1, k + 1);
+
+                    int config_n = 0;
+                    for (int c = 0; c < 8; c++)
+                        config_n |= (vs[c] < 0) << c;
+                    if (config_n == 0 || config_n == 255)
+                        continue;
+
+                    const uint64_t& config = mc_internalMarching_cube_tris[config_n];
+                    const size_t n_indices = (config & 0xF) * 3;
+                    int offset = 4;
+                    for (size_t t = 0; t < n_indices; t++)
                     {
-                        mc_internalAccumulateNormal(outputMesh,
-                            outputMesh.indices[indexBase + i * 3 + 0],
-                            outputMesh.indices[indexBase + i * 3 + 1],
-                            outputMesh.indices[indexBase + i * 3 + 2]);
+                        const int edge = (config >> offset) & 0xF;
+                        const uint64_t key = mc_internalEdgeKey(
+                            x0 + i + mc_internalEdgeOffset[edge][0],
+                            y0 + j + mc_internalEdgeOffset[edge][1],
+                            z0 + k + mc_internalEdgeOffset[edge][2],
+                            mc_internalEdgeAxis[edge], nx, ny);
+                        brick.triEdges.push_back(key);
+                        const int corner = mc_internalEdgeCorner[edge];
+                        brick.edges.push_back({ key, vs[corner], vs[corner + (1 << mc_internalEdgeAxis[edge])] });
+                        offset += 4;
+                    }
+                }
+            }
+        }
+
+        std::sort(brick.edges.begin(), brick.edges.end());
+        brick.edges.erase(std::unique(brick.edges.begin(), brick.edges.end()), brick.edges.end());
+        return sampled;
+    }
+
+    /*!
+      \brief Computes the zero isosurface like march_cubes, but only samples the lattice near it.
+
+      The cells are grouped into bricks of brickSize^3. A coarse lattice, brickSize * 2^seedLevels
+      apart, is refined octree-style wherever a cell's corners change sign (or, if lipschitz > 0,
+      wherever the field could reach zero inside the cell given that many units of change per
+      grid cell). Grids that can bound their own sign (getIndexSignBound) are refined wherever
+      they can't rule the surface out instead, which seeds every component. The bricks this reaches seed a flood fill that marches a brick and moves on to
+      each neighbour the surface crosses into, so every surface component touching a seed is
+      extracted whole, at full resolution, from the same lattice values as march_cubes.
+      Components that never cross a refined coarse cell are missed; lower seedLevels or a
+      lipschitz bound make the seeding denser. Without a lipschitz bound or a grid that can
+      bound its sign, seeding can't be conservative, so the whole lattice is marched instead.
+
+      Each wave of bricks is marched in two passes by checkerboard parity, so a brick copies
+      the faces it shares with bricks already marched instead of sampling them again.
+
+      Vertices are deduplicated through global edge keys and numbered in key order, so the
+      result doesn't depend on the thread count. With more than one thread, the grid must
+      support concurrent get()/getf() calls.
+      \param grid Grid3D scalar field or function of real values
+      \param outputMesh indexed mesh returned.
+      \param verbose if true, prints progress updates
+      \param brickSize cells per brick edge
+      \param seedLevels octree levels between the coarse seeding lattice and the bricks
+      \param lipschitz bound on |change in value| per grid cell for the seeding test, or 0
+      */
+    inline void march_cubes_sparse(Grid3D *grid, Mesh& outputMesh, bool verbose = false, uint brickSize = 16, uint seedLevels = 2, Real lipschitz = 0) {
+
+        const uint nx = grid->xRes;
+        const uint ny = grid->yRes;
+        const uint nz = grid->zRes;
+        if (nx < 2 || ny < 2 || nz < 2) return;
+
+        int probeSign;
+        if (!(lipschitz > 0) && !grid->getIndexSignBound(VEC3I(0, 0, 0), VEC3I(nx - 1, ny - 1, nz - 1), probeSign)) {
+            if (verbose) printf("Sparse marching needs a lipschitz bound or a grid that bounds its own sign; marching the whole lattice\n");
+            march_cubes(grid, outputMesh, verbose);
+            return;
+        }
+
+        brickSize = std::max<uint>(brickSize, 1);
+        const uint nbx = (nx - 2) / brickSize + 1;
+        const uint nby = (ny - 2) / brickSize + 1;
+        const uint nbz = (nz - 2) / brickSize + 1;
+
+        int numThreads = (defaultNumThreads == 0) ? omp_get_max_threads() : defaultNumThreads;
+        if (!grid->supportsConcurrentQueries()) numThreads = 1;
+
+        PB_START("Sparse marching cubes with res %dx%dx%d on %d thread(s)", nx, ny, nz, numThreads);
+        mc_internalResetRootFindingStats();
+        PB_PROGRESS(0);
+
+        // Octree descent from the coarse lattice down to seed bricks
+        std::vector<unsigned char> brickState((size_t) nbx * nby * nbz, 0); // 1 once queued
+        std::vector<uint64_t> frontier;
+        size_t numSamples = 0;
+
+        uint spacing = brickSize << seedLevels;
+        std::vector<VEC3I> cells;
+        for (uint z = 0; z < nz - 1; z += spacing)
+            for (uint y = 0; y < ny - 1; y += spacing)
+                for (uint x = 0; x < nx - 1; x += spacing)
+                    cells.push_back(VEC3I(x, y, z));
+
+        while (!cells.empty()) {
+            std::vector<uint64_t> keys;
+            keys.reserve(cells.size() * 8);
+            for (const VEC3I& c : cells)
+                for (int corner = 0; corner < 8; corner++)
+                    keys.push_back(mc_internalPointKey(
+                        std::min<uint>(c.x() + (corner & 1 ? spacing : 0), nx - 1),
+                        std::min<uint>(c.y() + (corner & 2 ? spacing : 0), ny - 1),
+                        std::min<uint>(c.z() + (corner & 4 ? spacing : 0), nz - 1), nx, ny));
+            std::sort(keys.begin(), keys.end());
+            keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+            std::vector<VEC3F> points(keys.size());
+            for (size_t i = 0; i < keys.size(); i++)
+                points[i] = VEC3F(keys[i] % nx, (keys[i] / nx) % ny, keys[i] / ((uint64_t) nx * ny));
+            std::vector<Real> values;
+            mc_internalSampleLattice(grid, points, values, numThreads);
+            numSamples += keys.size();
+
+            std::vector<VEC3I> refined;
+            for (const VEC3I& c : cells) {
+                bool neg = false, pos = false;
+                Real minAbs = std::numeric_limits<Real>::infinity();
+                for (int corner = 0; corner < 8; corner++) {
+                    const uint64_t key = mc_internalPointKey(
+                        std::min<uint>(c.x() + (corner & 1 ? spacing : 0), nx - 1),
+                        std::min<uint>(c.y() + (corner & 2 ? spacing : 0), ny - 1),
+                        std::min<uint>(c.z() + (corner & 4 ? spacing : 0), nz - 1), nx, ny);
+                    const Real v = values[std::lower_bound(keys.begin(), keys.end(), key) - keys.begin()];
+                    neg |= (v < 0);
+                    pos |= !(v < 0);
+                    minAbs = std::min(minAbs, (Real) fabs(v));
+                }
+
+                int sign;
+                const VEC3I hi(std::min<uint>(c.x() + spacing, nx - 1), std::min<uint>(c.y() + spacing, ny - 1), std::min<uint>(c.z() + spacing, nz - 1));
+                if (grid->getIndexSignBound(c, hi, sign)) {
+                    if (sign != 0) continue;
+                } else if (!(neg && pos) && !(minAbs <= lipschitz * spacing * std::sqrt(3.0) / 2)) {
+                    continue;
+                }
+
+                if (spacing == brickSize) {
+                    const uint64_t b = ((uint64_t) (c.z() / brickSize) * nby + c.y() / brickSize) * nbx + c.x() / brickSize;
+                    if (!brickState[b]) {
+                        brickState[b] = 1;
+                        frontier.push_back(b);
                     }
+                    continue;
+                }
+
+                const uint half = spacing / 2;
+                for (int child = 0; child < 8; child++) {
+                    const VEC3I o(c.x() + (child & 1 ? half : 0), c.y() + (child & 2 ? half : 0), c.z() + (child & 4 ? half : 0));
+                    if ((uint) o.x() < nx - 1 && (uint) o.y() < ny - 1 && (uint) o.z() < nz - 1)
+                        refined.push_back(o);
+                }
+            }
+
+            if (spacing == brickSize) break;
+            spacing /= 2;
+            cells.swap(refined);
+        }
+        std::sort(frontier.begin(), frontier.end());
 
+        // Flood fill along the surface, one wave of bricks at a time. Face neighbours differ in
+        // parity, so marching the even bricks of a wave before the odd ones lets every shared
+        // face be sampled once.
+        std::vector<mc_internalBrick> bricks;
+        std::vector<int64_t> brickSlot(brickState.size(), -1); // index in bricks once marched
+        while (!frontier.empty()) {
+            const size_t base = bricks.size();
+            bricks.resize(base + frontier.size());
+
+            for (int parity = 0; parity < 2; parity++) {
+                std::vector<size_t> pass;
+                for (size_t i = 0; i < frontier.size(); i++) {
+                    const uint64_t b = frontier[i];
+                    if ((b % nbx + (b / nbx) % nby + b / ((uint64_t) nbx * nby)) % 2 == (uint64_t) parity) pass.push_back(i);
+                }
+
+                #pragma omp parallel num_threads(numThreads) reduction(+:numSamples)
+                {
+                    std::vector<Real> values;
+
+                    #pragma omp for schedule(dynamic, 1)
+                    for (size_t p = 0; p < pass.size(); p++) {
+                        const uint64_t b = frontier[pass[p]];
+                        const uint bx = b % nbx, by = (b / nbx) % nby, bz = b / ((uint64_t) nbx * nby);
+                        const bool inRange[6] = { bx > 0, bx + 1 < nbx, by > 0, by + 1 < nby, bz > 0, bz + 1 < nbz };
+                        const int64_t step[6] = { -1, 1, -(int64_t) nbx, (int64_t) nbx, -(int64_t) nbx * nby, (int64_t) nbx * nby };
+
+                        const std::vector<Real>* shared[6];
+                        for (int f = 0; f < 6; f++) {
+                            const int64_t slot = inRange[f] ? brickSlot[b + step[f]] : -1;
+                            shared[f] = (slot >= 0) ? &bricks[slot].faces[f ^ 1] : NULL;
+                        }
+
+                        mc_internalBrick& brick = bricks[base + pass[p]];
+                        brick.id = b;
+                        numSamples += mc_internalMarchBrick(grid, bx, by, bz, brickSize, brick, values, shared);
+                    }
                 }
+
+                for (size_t i : pass)
+                    brickSlot[frontier[i]] = base + i;
             }
 
-            PB_PROGRESS((float) z / nz);
+            std::vector<uint64_t> next;
+            for (size_t i = base; i < bricks.size(); i++) {
+                const uint64_t b = bricks[i].id;
+                const uint bx = b % nbx, by = (b / nbx) % nby, bz = b / ((uint64_t) nbx * nby);
+                const bool inRange[6] = { bx > 0, bx + 1 < nbx, by > 0, by + 1 < nby, bz > 0, bz + 1 < nbz };
+                const int64_t step[6] = { -1, 1, -(int64_t) nbx, (int64_t) nbx, -(int64_t) nbx * nby, (int64_t) nbx * nby };
+                for (int f = 0; f < 6; f++) {
+                    if (!(bricks[i].faceMask & (1u << f)) || !inRange[f]) continue;
+                    const uint64_t neighbour = b + step[f];
+                    if (!brickState[neighbour]) {
+                        brickState[neighbour] = 1;
+                        next.push_back(neighbour);
+                    }
+                }
+            }
+            std::sort(next.begin(), next.end());
+            frontier.swap(next);
 
+            PB_PROGRESS((float) bricks.size() / (bricks.size() + frontier.size()));
             fflush(stdout);
         }
 
-        delete[] slab_inds;
+        for (mc_internalBrick& brick : bricks)
+            for (int f = 0; f < 6; f++)
+                brick.faces[f] = std::vector<Real>();
+        std::sort(bricks.begin(), bricks.end(), [](const mc_internalBrick& a, const mc_internalBrick& b) { return a.id < b.id; });
+
+        // Deduplicate the crossed edges and find their roots
+        std::vector<mc_internalEdge> edges;
+        for (mc_internalBrick& brick : bricks) {
+            edges.insert(edges.end(), brick.edges.begin(), brick.edges.end());
+            brick.edges = std::vector<mc_internalEdge>();
+        }
+        std::sort(edges.begin(), edges.end());
+        edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+
+        const size_t firstVertex = outputMesh.vertices.size();
+        const size_t firstIndex  = outputMesh.indices.size();
+        outputMesh.vertices.resize(firstVertex + edges.size());
+
+        #pragma omp parallel for schedule(dynamic, 256) num_threads(numThreads)
+        for (size_t i = 0; i < edges.size(); i++) {
+            const uint64_t point = edges[i].key / 3;
+            outputMesh.vertices[firstVertex + i] = mc_internalFindRoot(grid, edges[i].va, edges[i].vb, edges[i].key % 3,
+                point % nx, (point / nx) % ny, point / ((uint64_t) nx * ny));
+        }
+
+        std::vector<uint64_t> edgeKeys(edges.size());
+        for (size_t i = 0; i < edges.size(); i++)
+            edgeKeys[i] = edges[i].key;
+        edges = std::vector<mc_internalEdge>();
+
+        std::vector<size_t> indexOffsets(bricks.size());
+        size_t totalIndices = firstIndex;
+        for (size_t b = 0; b < bricks.size(); b++) {
+            indexOffsets[b] = totalIndices;
+            totalIndices += bricks[b].triEdges.size();
+        }
+        outputMesh.indices.resize(totalIndices);
+
+        #pragma omp parallel for schedule(dynamic, 1) num_threads(numThreads)
+        for (size_t b = 0; b < bricks.size(); b++) {
+            const std::vector<uint64_t>& triEdges = bricks[b].triEdges;
+            for (size_t t = 0; t < triEdges.size(); t++) {
+                const size_t v = std::lower_bound(edgeKeys.begin(), edgeKeys.end(), triEdges[t]) - edgeKeys.begin();
+                outputMesh.indices[indexOffsets[b] + t] = firstVertex + v;
+            }
+        }
+
+        outputMesh.normals.resize(outputMesh.vertices.size(), VEC3F(0, 0, 0));
+        for (size_t i = firstIndex; i < totalIndices; i += 3)
+        {
+            mc_internalAccumulateNormal(outputMesh,
+                outputMesh.indices[i + 0],
+                outputMesh.indices[i + 1],
+                outputMesh.indices[i + 2]);
+        }
 
         PB_END();
 
-        if (verbose) printf("\n");
+        const size_t lattice = (size_t) nx * ny * nz;
+        if (verbose) {
+            printf("Marched %zu of %zu bricks; sampled %zu lattice points (%.1f%% of the full lattice)\n",
+                bricks.size(), brickState.size(), numSamples, 100.0 * numSamples / lattice);
+            mc_internalPrintRootFindingStats();
+        }
 
-        for (size_t i = 0; i < outputMesh.normals.size(); i++)
+        for (size_t i = firstVertex; i < outputMesh.normals.size(); i++)
             outputMesh.normals[i] = mc_internalNormalize(outputMesh.normals[i]);
 
     }
 
+    /*!
+      \brief Merges vertices with the same key and recomputes the normals. The first
+      occurrence of each key keeps its place, so the result is deterministic.
+      \param mesh the mesh, modified in place
+      \param vertexKeys one key per vertex, e.g. the grid edge it was found on
+      \return number of vertices removed
+      */
+    inline size_t weldVertices(Mesh& mesh, const std::vector<uint64_t>& vertexKeys)
+    {
+        std::unordered_map<uint64_t, uint> firstAt;
+        firstAt.reserve(mesh.vertices.size());
+
+        std::vector<uint> remap(mesh.vertices.size());
+        std::vector<VEC3F> welded;
+        welded.reserve(mesh.vertices.size());
+        for (size_t i = 0; i < mesh.vertices.size(); i++) {
+            auto found = firstAt.emplace(vertexKeys[i], (uint) welded.size());
+            if (found.second) welded.push_back(mesh.vertices[i]);
+            remap[i] = found.first->second;
+        }
+
+        const size_t removed = mesh.vertices.size() - welded.size();
+        mesh.vertices.swap(welded);
+        for (uint& index : mesh.indices)
+            index = remap[index];
+
+        mesh.normals.assign(mesh.vertices.size(), VEC3F(0, 0, 0));
+        for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3)
+            mc_internalAccumulateNormal(mesh, mesh.indices[i], mesh.indices[i + 1], mesh.indices[i + 2]);
+        for (size_t i = 0; i < mesh.normals.size(); i++)
+            mesh.normals[i] = mc_internalNormalize(mesh.normals[i]);
+
+        return removed;
+    }
+
+    /*!
+      \brief Logs predicted against measured tile times. Costs are scaled to seconds so that
+      both columns add up to the same total; for many tiles only the slowest are listed.
+      */
+    static void mc_internalPrintTileTimes(const std::vector<VEC3I>& windowMin, const std::vector<VEC3I>& windowMax, const std::vector<double>& cost, const std::vector<double>& seconds)
+    {
+        const size_t n = cost.size();
+        double totalCost = 0, totalSeconds = 0;
+        for (size_t t = 0; t < n; t++) {
+            totalCost += cost[t];
+            totalSeconds += seconds[t];
+        }
+        const double scale = totalCost > 0 ? totalSeconds / totalCost : 0;
+
+        // Pearson correlation of predicted and measured times
+        const double meanCost = totalCost / n, meanSeconds = totalSeconds / n;
+        double sxy = 0, sxx = 0, syy = 0;
+        for (size_t t = 0; t < n; t++) {
+            sxy += (cost[t] - meanCost) * (seconds[t] - meanSeconds);
+            sxx += (cost[t] - meanCost) * (cost[t] - meanCost);
+            syy += (seconds[t] - meanSeconds) * (seconds[t] - meanSeconds);
+        }
+
+        std::vector<size_t> order(n);
+        for (size_t t = 0; t < n; t++)
+            order[t] = t;
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return seconds[a] > seconds[b]; });
+
+        const size_t shown = (n <= 64) ? n : 16;
+        printf("Tile times, predicted vs actual (%zu of %zu tiles, slowest first):\n", shown, n);
+        for (size_t i = 0; i < shown; i++) {
+            const size_t t = order[i];
+            printf("    tile %4zu  [%4d %4d %4d] - [%4d %4d %4d]  predicted %8.3fs  actual %8.3fs\n", t,
+                windowMin[t].x(), windowMin[t].y(), windowMin[t].z(), windowMax[t].x(), windowMax[t].y(), windowMax[t].z(),
+                cost[t] * scale, seconds[t]);
+        }
+        printf("Correlation of predicted and actual tile times: %.3f\n", (sxx > 0 && syy > 0) ? sxy / std::sqrt(sxx * syy) : 0.0);
+    }
+
+    /*!
+      \brief Marches a set of lattice windows of the grid as independent tasks and welds the
+      pieces into one mesh, in grid index space like march_cubes.
+
+      Each window is [windowMin, windowMax] in grid indices (inclusive). Windows that share a
+      face share its lattice plane, so they both create the vertices of the grid edges in it,
+      which are welded by edge; the result has the topology of march_cubes. Idle threads take the next window as soon as they free up,
+      which keeps them busy when surface density varies a lot between windows. With more than
+      one thread, the grid must support concurrent get()/getf() calls.
+
+      Given a predicted cost per tile, the most expensive tiles are started first so a slow
+      tile doesn't start last and set the wall time, and (if verbose) the prediction is logged
+      against the measured time of each tile. The mesh doesn't depend on the order.
+      \param grid Grid3D scalar field or function of real values
+      \param windowMin, windowMax lattice windows, one tile each
+      \param outputMesh indexed mesh returned.
+      \param verbose if true, prints progress updates
+      \param predictedCost optional cost estimate per tile, in any unit
+      \param tileSeconds optional output, wall time spent on each tile
+      */
+    inline void march_cubes_tiled(Grid3D *grid, const std::vector<VEC3I>& windowMin, const std::vector<VEC3I>& windowMax, Mesh& outputMesh, bool verbose = false,
+                                  const std::vector<double>* predictedCost = 0, std::vector<double>* tileSeconds = 0) {
+
+        const size_t numTiles = windowMin.size();
+
+        int numThreads = (defaultNumThreads == 0) ? omp_get_max_threads() : defaultNumThreads;
+        if (!grid->supportsConcurrentQueries()) numThreads = 1;
+
+        std::vector<Mesh> tileMeshes(numTiles);
+        std::vector<std::vector<uint64_t>> tileEdges(numTiles);
+        std::vector<double> seconds(numTiles, 0);
+        size_t tilesDone = 0;
+
+        // Longest predicted first
+        std::vector<size_t> order(numTiles);
+        for (size_t t = 0; t < numTiles; t++)
+            order[t] = t;
+        if (predictedCost) {
+            std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return (*predictedCost)[a] > (*predictedCost)[b]; });
+        }
+
+        PB_START("Marching %zu tiles on %d thread(s)", numTiles, numThreads);
+        mc_internalResetRootFindingStats();
+
+        #pragma omp parallel num_threads(numThreads)
+        #pragma omp single
+        {
+            for (size_t t : order) {
+                #pragma omp task firstprivate(t)
+                {
+                    const double start = omp_get_wtime();
+                    if ((windowMax[t] - windowMin[t]).minCoeff() >= 1)
+                        march_cubes_window(grid, windowMin[t], windowMax[t], tileMeshes[t], false, &tileEdges[t]);
+                    seconds[t] = omp_get_wtime() - start;
+
+                    #pragma omp critical
+                    {
+                        tilesDone++;
+                        PB_PROGRESS((float) tilesDone / numTiles);
+                        fflush(stdout);
+                    }
+                }
+            }
+        }
+
+        // Vertices already in outputMesh get keys no grid edge has, so they are left alone
+        std::vector<uint64_t> vertexEdges(outputMesh.vertices.size());
+        for (size_t i = 0; i < vertexEdges.size(); i++)
+            vertexEdges[i] = std::numeric_limits<uint64_t>::max() - i;
+
+        for (size_t t = 0; t < numTiles; t++) {
+            const uint vertexOffset = outputMesh.vertices.size();
+            outputMesh.vertices.insert(outputMesh.vertices.end(), tileMeshes[t].vertices.begin(), tileMeshes[t].vertices.end());
+            vertexEdges.insert(vertexEdges.end(), tileEdges[t].begin(), tileEdges[t].end());
+            for (uint index : tileMeshes[t].indices)
+                outputMesh.indices.push_back(vertexOffset + index);
+            tileMeshes[t] = Mesh();
+            tileEdges[t] = std::vector<uint64_t>();
+        }
+
+        const size_t before = outputMesh.vertices.size();
+        const size_t removed = weldVertices(outputMesh, vertexEdges);
+
+        PB_END();
+
+        if (verbose) {
+            printf("\nWelded %zu of %zu tile vertices on shared faces\n", removed, before);
+            mc_internalPrintRootFindingStats();
+            if (predictedCost) mc_internalPrintTileTimes(windowMin, windowMax, *predictedCost, seconds);
+        }
+
+        if (tileSeconds) tileSeconds->swap(seconds);
+    }
+
 }
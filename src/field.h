@@ -4,7 +4,15 @@
 #include <fstream>
 #include <iostream>
 #include <unordered_map>
-#include <queue>
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <cassert>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "SETTINGS.h"
 
@@ -118,6 +126,14 @@ public:
         return getFieldValue(pos);
     }
 
+    // Evaluates n points in one call. Fields on the sampling hot path override
+    // this so virtual dispatch is paid once per batch rather than once per point.
+    virtual void getFieldValues(const VEC3F* pos, Real* out, size_t n) const {
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = getFieldValue(pos[i]);
+        }
+    }
+
     virtual VEC3F getNumericalGradient(const VEC3F& pos, Real eps) const {
         Real x = pos[0];
         Real y = pos[1];
@@ -185,6 +201,13 @@ public:
         return getFieldValue(pos);
     }
 
+    // Evaluates n points in one call; see FieldFunction3D::getFieldValues
+    virtual void getFieldValues(const VEC3F* pos, VEC3F* out, size_t n) const {
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = getFieldValue(pos[i]);
+        }
+    }
+
     FieldFunction3D *x, *y, *z, *mag;
 
 };
@@ -222,6 +245,369 @@ public:
         return value;
     }
 
+    virtual void getFieldValues(const VEC3F* pos, Real* out, size_t n) const {
+        (void) pos;
+        fill(out, out + n, value);
+    }
+
+};
+
+class Grid3D;
+
+/*
+   F3D v2 container. A header and an index are followed by independently compressed bricks,
+   so any part of the grid can be read without the rest:
+       char[4] "F3D2", uint32 version, uint32 dtype (see DTYPE)
+       int32 xRes, yRes, zRes, float64 center[3], float64 lengths[3]
+       float64 quantization step, for INT16 only
+       uint32 brickSize, uint64 numBricks
+       numBricks x { uint64 file offset, uint32 bytes, uint32 codec }
+       brick payloads
+   Bricks are ordered z-major like ArrayGrid3D and hold their cells in the same order, cut
+   to the grid on the far faces. Unlike v1, a v2 file reads back exactly as it was written.
+   A v1 file starts with xRes, which can't look like the magic.
+*/
+class F3D2File {
+public:
+    enum DTYPE {
+        FLOAT64 = 0,
+        FLOAT32 = 1,
+        INT16 = 2     // value = stored integer * quantization step
+    };
+
+    enum CODEC {
+        RAW = 0,              // values as they are
+        XOR_SHUFFLE_RLE = 1   // each value XORed with the previous one, bytes grouped by significance, PackBits RLE
+    };
+
+    static size_t elementBytes(uint32_t dtype) {
+        return (dtype == FLOAT64) ? 8 : (dtype == FLOAT32) ? 4 : 2;
+    }
+
+    struct BrickEntry {
+        uint64_t offset;
+        uint32_t bytes;
+        uint32_t codec;
+    };
+
+    static constexpr uint32_t version = 2;
+    static constexpr uint32_t defaultBrickSize = 16;
+
+    int xRes, yRes, zRes;
+    VEC3F center, lengths;
+    uint32_t dtype;
+    double quantizationStep = 0;
+    uint32_t brickSize;
+    int bricksX, bricksY, bricksZ;
+    vector<BrickEntry> index;
+
+    static bool isF3D2(const string& filename) {
+        char magic[4] = {0};
+        FILE* file = fopen(filename.c_str(), "rb");
+        if (file == NULL) return false;
+        const bool ok = fread(magic, 1, 4, file) == 4 && memcmp(magic, "F3D2", 4) == 0;
+        fclose(file);
+        return ok;
+    }
+
+    // Reads the header and brick index; bricks are read on demand with readBrick
+    F3D2File(const string& filename): filename(filename) {
+        fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0) {
+            printf("Failed to read F3D2 %s: file open failed!\n", filename.c_str());
+            exit(1);
+        }
+
+        char magic[4];
+        uint32_t fileVersion;
+        double c[3], l[3];
+        uint64_t numBricks;
+        size_t at = 0;
+        readAt(magic, 4, at);
+        readAt(&fileVersion, 4, at);
+        readAt(&dtype, 4, at);
+        readAt(&xRes, 4, at);
+        readAt(&yRes, 4, at);
+        readAt(&zRes, 4, at);
+        readAt(c, sizeof(c), at);
+        readAt(l, sizeof(l), at);
+
+        if (memcmp(magic, "F3D2", 4) != 0 || fileVersion != version || dtype > INT16) {
+            printf("Failed to read F3D2 %s: not a version %u F3D2 file!\n", filename.c_str(), version);
+            exit(1);
+        }
+
+        if (dtype == INT16) readAt(&quantizationStep, 8, at);
+        readAt(&brickSize, 4, at);
+        readAt(&numBricks, 8, at);
+        center = VEC3F(c[0], c[1], c[2]);
+        lengths = VEC3F(l[0], l[1], l[2]);
+
+        bricksX = (xRes + brickSize - 1) / brickSize;
+        bricksY = (yRes + brickSize - 1) / brickSize;
+        bricksZ = (zRes + brickSize - 1) / brickSize;
+        if (xRes <= 0 || yRes <= 0 || zRes <= 0 || brickSize == 0 || numBricks != (uint64_t) bricksX * bricksY * bricksZ) {
+            printf("Failed to read F3D2 %s: bad header (res %d x %d x %d, %u^3 bricks, %lu of them)!\n",
+                filename.c_str(), xRes, yRes, zRes, brickSize, (unsigned long) numBricks);
+            exit(1);
+        }
+
+        index.resize(numBricks);
+        readAt(index.data(), numBricks * sizeof(BrickEntry), at);
+    }
+
+    ~F3D2File() {
+        close(fd);
+    }
+
+    size_t numBricks() const { return index.size(); }
+
+    size_t brickIndex(int bx, int by, int bz) const {
+        return ((size_t) bz * bricksY + by) * bricksX + bx;
+    }
+
+    VEC3I brickOrigin(size_t b) const {
+        return VEC3I(b % bricksX, (b / bricksX) % bricksY, b / ((size_t) bricksX * bricksY)) * brickSize;
+    }
+
+    VEC3I brickDims(size_t b) const {
+        const VEC3I o = brickOrigin(b);
+        return VEC3I(min<int>(brickSize, xRes - o.x()), min<int>(brickSize, yRes - o.y()), min<int>(brickSize, zRes - o.z()));
+    }
+
+    // Decodes brick b into out, brickDims(b).prod() values. Safe to call from several threads.
+    void readBrick(size_t b, Real* out) const {
+        const BrickEntry& e = index[b];
+        vector<char> data(e.bytes);
+        if (pread(fd, data.data(), e.bytes, e.offset) != (ssize_t) e.bytes) {
+            printf("Failed to read brick %zu of F3D2 %s!\n", b, filename.c_str());
+            exit(1);
+        }
+
+        const size_t n = brickDims(b).prod();
+        vector<char> values(n * elementBytes(dtype));
+        if (!decode(data.data(), e.bytes, e.codec, values.data(), n, elementBytes(dtype))) {
+            printf("Brick %zu of F3D2 %s is corrupt!\n", b, filename.c_str());
+            exit(1);
+        }
+
+        switch (dtype) {
+        case FLOAT64: copy_n((const double*) values.data(), n, out); break;
+        case FLOAT32: copy_n((const float*) values.data(), n, out); break;
+        case INT16:
+            for (size_t i = 0; i < n; i++) out[i] = ((const int16_t*) values.data())[i] * quantizationStep;
+            break;
+        }
+    }
+
+    // Compresses n values of elementSize bytes, falling back to RAW when that doesn't make
+    // them smaller
+    static uint32_t encode(const void* values, size_t n, size_t elementSize, vector<char>& out) {
+        vector<uint64_t> bits(n, 0);
+        for (size_t i = 0; i < n; i++)
+            memcpy(&bits[i], (const char*) values + i * elementSize, elementSize);
+        for (size_t i = n; i-- > 1;)
+            bits[i] ^= bits[i - 1];
+
+        vector<unsigned char> shuffled(n * elementSize);
+        for (size_t i = 0; i < n; i++)
+            for (size_t b = 0; b < elementSize; b++)
+                shuffled[b * n + i] = (bits[i] >> (8 * b)) & 0xff;
+
+        // PackBits: c < 128 is followed by c + 1 literal bytes, c >= 128 by one byte repeated c - 125 times
+        out.clear();
+        size_t i = 0;
+        while (i < shuffled.size()) {
+            size_t run = 1;
+            while (i + run < shuffled.size() && run < 130 && shuffled[i + run] == shuffled[i]) run++;
+            if (run >= 3) {
+                out.push_back(char(run + 125));
+                out.push_back(char(shuffled[i]));
+                i += run;
+                continue;
+            }
+
+            size_t literal = 0;
+            while (i + literal < shuffled.size() && literal < 128) {
+                const size_t j = i + literal;
+                if (j + 2 < shuffled.size() && shuffled[j] == shuffled[j + 1] && shuffled[j] == shuffled[j + 2]) break;
+                literal++;
+            }
+            out.push_back(char(literal - 1));
+            out.insert(out.end(), shuffled.begin() + i, shuffled.begin() + i + literal);
+            i += literal;
+        }
+
+        if (out.size() < n * elementSize) return XOR_SHUFFLE_RLE;
+
+        out.resize(n * elementSize);
+        memcpy(out.data(), values, n * elementSize);
+        return RAW;
+    }
+
+    static bool decode(const char* data, size_t bytes, uint32_t codec, void* out, size_t n, size_t elementSize) {
+        if (codec == RAW) {
+            if (bytes != n * elementSize) return false;
+            memcpy(out, data, bytes);
+            return true;
+        }
+        if (codec != XOR_SHUFFLE_RLE) return false;
+
+        vector<unsigned char> shuffled(n * elementSize);
+        size_t o = 0;
+        for (size_t i = 0; i < bytes;) {
+            const unsigned char c = data[i++];
+            if (c < 128) {
+                const size_t literal = c + 1;
+                if (i + literal > bytes || o + literal > shuffled.size()) return false;
+                memcpy(&shuffled[o], data + i, literal);
+                i += literal;
+                o += literal;
+            } else {
+                const size_t run = c - 125;
+                if (i >= bytes || o + run > shuffled.size()) return false;
+                memset(&shuffled[o], (unsigned char) data[i++], run);
+                o += run;
+            }
+        }
+        if (o != shuffled.size()) return false;
+
+        uint64_t previous = 0;
+        for (size_t i = 0; i < n; i++) {
+            uint64_t v = 0;
+            for (size_t b = 0; b < elementSize; b++)
+                v |= uint64_t(shuffled[b * n + i]) << (8 * b);
+            previous ^= v;
+            memcpy((char*) out + i * elementSize, &previous, elementSize);
+        }
+        return true;
+    }
+
+    // Converts n values to dtype and compresses them into out, returning the codec
+    static uint32_t encodeBrick(const double* values, size_t n, uint32_t dtype, Real band, vector<char>& out) {
+        const size_t elementSize = elementBytes(dtype);
+        const double quantizationStep = band / 32767;
+        vector<char> typed(n * elementSize);
+        for (size_t i = 0; i < n; i++) {
+            if (dtype == FLOAT64) {
+                memcpy(&typed[i * 8], &values[i], 8);
+            } else if (dtype == FLOAT32) {
+                const float f = values[i];
+                memcpy(&typed[i * 4], &f, 4);
+            } else {
+                const int16_t q = lrint(min<double>(band, max<double>(-band, values[i])) / quantizationStep);
+                memcpy(&typed[i * 2], &q, 2);
+            }
+        }
+        return encode(typed.data(), n, elementSize, out);
+    }
+
+    // Writes an F3D2 file a brick at a time, in any order, so a grid never has to be in
+    // memory all at once. The payloads are appended as they come and the index goes in on close().
+    class Writer {
+    public:
+        const int xRes, yRes, zRes;
+        const uint32_t dtype, brickSize;
+        const Real band;
+        const int bricksX, bricksY, bricksZ;
+
+        Writer(const string& filename, int xRes, int yRes, int zRes, const AABB& bounds,
+               uint32_t dtype = FLOAT64, Real band = 0, uint32_t brickSize = defaultBrickSize):
+            xRes(xRes), yRes(yRes), zRes(zRes), dtype(dtype), brickSize(brickSize), band(band),
+            bricksX((xRes + brickSize - 1) / brickSize), bricksY((yRes + brickSize - 1) / brickSize),
+            bricksZ((zRes + brickSize - 1) / brickSize), filename(filename) {
+            file = fopen(filename.c_str(), "wb");
+            if (file == NULL) {
+                printf("Failed to write F3D2 %s: file open failed!\n", filename.c_str());
+                exit(1);
+            }
+            if (dtype == INT16 && band <= 0) {
+                printf("Failed to write F3D2 %s: INT16 needs a quantization band!\n", filename.c_str());
+                exit(1);
+            }
+
+            const uint64_t n = numBricks();
+            const double c[3] = { bounds.center()[0], bounds.center()[1], bounds.center()[2] };
+            const double l[3] = { bounds.span()[0], bounds.span()[1], bounds.span()[2] };
+            const double quantizationStep = band / 32767;
+            fwrite("F3D2", 1, 4, file);
+            fwrite(&version, 4, 1, file);
+            fwrite(&dtype, 4, 1, file);
+            fwrite(&xRes, 4, 1, file);
+            fwrite(&yRes, 4, 1, file);
+            fwrite(&zRes, 4, 1, file);
+            fwrite(c, sizeof(c), 1, file);
+            fwrite(l, sizeof(l), 1, file);
+            if (dtype == INT16) fwrite(&quantizationStep, 8, 1, file);
+            fwrite(&brickSize, 4, 1, file);
+            fwrite(&n, 8, 1, file);
+
+            indexOffset = ftell(file);
+            entries.assign(n, BrickEntry{0, 0, 0});
+            fwrite(entries.data(), sizeof(BrickEntry), n, file);
+            offset = indexOffset + n * sizeof(BrickEntry);
+        }
+
+        ~Writer() {
+            if (file != NULL) close();
+        }
+
+        size_t numBricks() const { return (size_t) bricksX * bricksY * bricksZ; }
+
+        VEC3I brickOrigin(size_t b) const {
+            return VEC3I(b % bricksX, (b / bricksX) % bricksY, b / ((size_t) bricksX * bricksY)) * brickSize;
+        }
+
+        VEC3I brickDims(size_t b) const {
+            const VEC3I o = brickOrigin(b);
+            return VEC3I(min<int>(brickSize, xRes - o.x()), min<int>(brickSize, yRes - o.y()), min<int>(brickSize, zRes - o.z()));
+        }
+
+        // Appends brick b, encoded with encodeBrick. Not thread safe.
+        void writeBrick(size_t b, const vector<char>& payload, uint32_t codec) {
+            entries[b] = BrickEntry{offset, (uint32_t) payload.size(), codec};
+            fwrite(payload.data(), 1, payload.size(), file);
+            offset += payload.size();
+        }
+
+        // Writes the index and closes the file, returning its size in bytes
+        uint64_t close() {
+            for (size_t b = 0; b < entries.size(); b++) {
+                if (entries[b].bytes == 0) {
+                    printf("Failed to write F3D2 %s: brick %zu was never written!\n", filename.c_str(), b);
+                    exit(1);
+                }
+            }
+            fseek(file, indexOffset, SEEK_SET);
+            fwrite(entries.data(), sizeof(BrickEntry), entries.size(), file);
+            fclose(file);
+            file = NULL;
+            return offset;
+        }
+
+    private:
+        string filename;
+        FILE* file;
+        vector<BrickEntry> entries;
+        uint64_t indexOffset, offset;
+    };
+
+    // Writes grid to filename as dtype, compressing the bricks in parallel. INT16 covers
+    // [-band, band], with band = 0 meaning the largest magnitude in the grid. Defined after Grid3D.
+    static void write(const string& filename, const Grid3D& grid, const AABB& bounds, bool verbose = false,
+                      uint32_t dtype = FLOAT64, Real band = 0, uint32_t brickSize = defaultBrickSize);
+
+private:
+    string filename;
+    int fd;
+
+    void readAt(void* out, size_t bytes, size_t& at) const {
+        if (pread(fd, out, bytes, at) != (ssize_t) bytes) {
+            printf("Failed to read F3D2 %s: file is truncated!\n", filename.c_str());
+            exit(1);
+        }
+        at += bytes;
+    }
 };
 
 class Grid3D: public FieldFunction3D {
@@ -238,6 +624,12 @@ public:
         return xRes * yRes * zRes;
     }
 
+    // Whether get() and getf() may be called from several threads at once. Grids
+    // that mutate internal state on lookup (e.g. caches) must override this.
+    virtual bool supportsConcurrentQueries() const {
+        return true;
+    }
+
     virtual Real get(uint x, uint y, uint z) const = 0;
 
     virtual Real getf(Real x, Real y, Real z) const {
@@ -254,21 +646,60 @@ public:
         return getf(pos[0], pos[1], pos[2]);
     }
 
+    // Fills out[0..n) with the lattice values at (x0 + i, y, z). Overrides should sample the
+    // same way whatever the span, so that pieces of a row match the whole row bit for bit.
+    virtual void getRowSpan(uint x0, uint n, uint y, uint z, Real* out) const {
+        for (uint i = 0; i < n; ++i) {
+            out[i] = get(x0 + i, y, z);
+        }
+    }
+
+    // Fills out[0..xRes) with the lattice values of row (y, z)
+    void getRow(uint y, uint z, Real* out) const {
+        getRowSpan(0, xRes, y, z, out);
+    }
+
+    // Batched getf over n (non-integer) grid indices
+    virtual void getfValues(const VEC3F* indices, Real* out, size_t n) const {
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = getf(indices[i]);
+        }
+    }
+
     virtual void setMapBox(AABB box) {
         mapBox = box;
         hasMapBox = true;
     }
 
+    // Conservative [lo, hi] bounds on getFieldValue over a box in field coordinates.
+    // Returns false if the grid can't bound itself without sampling a function.
+    virtual bool getFieldBounds(const AABB& box, Real& lo, Real& hi) const {
+        if (supportsNonIntegerIndices || !hasMapBox) return false;
+        return latticeBounds(box, lo, hi);
+    }
+
+    // Sign bound over the lattice box [lo, hi] (inclusive, grid indices). Returns false if the
+    // grid can't bound itself; otherwise sign is +1 or -1 if every value in the box has that
+    // sign, or 0 if the box may contain the zero crossing.
+    virtual bool getIndexSignBound(const VEC3I& lo, const VEC3I& hi, int& sign) const {
+        (void) lo; (void) hi; (void) sign;
+        return false;
+    }
+
+    VEC3F fieldToGridIndices(const VEC3F& pos) const {
+        VEC3F samplePoint = (pos - mapBox.min()).cwiseQuotient(mapBox.span());
+        samplePoint = samplePoint.cwiseMax(VEC3F(0,0,0)).cwiseMin(VEC3F(1,1,1));
+
+        return samplePoint.cwiseProduct(VEC3F(xRes-1, yRes-1, zRes-1));
+    }
+
     virtual Real getFieldValue(const VEC3F& pos) const override {
         if (!hasMapBox) {
             printf("Attempting getFieldValue on a Grid3D without a mapBox!\n");
             exit(1);
         }
 
-        VEC3F samplePoint = (pos - mapBox.min()).cwiseQuotient(mapBox.span());
-        samplePoint = samplePoint.cwiseMax(VEC3F(0,0,0)).cwiseMin(VEC3F(1,1,1));
-
-        const VEC3F indices = samplePoint.cwiseProduct(VEC3F(xRes-1, yRes-1, zRes-1));
+        const VEC3F indices = fieldToGridIndices(pos);
 
         if (supportsNonIntegerIndices) {
             return getf(indices);
@@ -277,6 +708,53 @@ public:
         }
     }
 
+    virtual void getFieldValues(const VEC3F* pos, Real* out, size_t n) const override {
+        if (!hasMapBox) {
+            printf("Attempting getFieldValues on a Grid3D without a mapBox!\n");
+            exit(1);
+        }
+
+        if (!supportsNonIntegerIndices) {
+            for (size_t i = 0; i < n; ++i) {
+                out[i] = get(fieldToGridIndices(pos[i]).cast<int>());
+            }
+            return;
+        }
+
+        vector<VEC3F> indices(n);
+        for (size_t i = 0; i < n; ++i) {
+            indices[i] = fieldToGridIndices(pos[i]);
+        }
+        getfValues(indices.data(), out, n);
+    }
+
+protected:
+    // Min/max over every lattice value that getFieldValue can blend for points in
+    // the box. Any interpolation that stays within the cell corners is covered.
+    bool latticeBounds(const AABB& box, Real& lo, Real& hi) const {
+        const VEC3F i0 = fieldToGridIndices(box.min());
+        const VEC3F i1 = fieldToGridIndices(box.max());
+
+        const uint x0 = floor(i0[0]), x1 = min((uint) floor(i1[0]) + 1, xRes - 1);
+        const uint y0 = floor(i0[1]), y1 = min((uint) floor(i1[1]) + 1, yRes - 1);
+        const uint z0 = floor(i0[2]), z1 = min((uint) floor(i1[2]) + 1, zRes - 1);
+
+        lo =  numeric_limits<Real>::infinity();
+        hi = -numeric_limits<Real>::infinity();
+        for (uint z = z0; z <= z1; ++z) {
+            for (uint y = y0; y <= y1; ++y) {
+                for (uint x = x0; x <= x1; ++x) {
+                    const Real v = get(x, y, z);
+                    lo = min(lo, v);
+                    hi = max(hi, v);
+                }
+            }
+        }
+        return true;
+    }
+
+public:
+
     virtual VEC3F gridToFieldCoords(const VEC3F& pos) const {
         if (!hasMapBox) {
             printf("Attempting cellToFieldCoords on a Grid3D without a mapBox!\n");
@@ -361,40 +839,272 @@ public:
 
         const int totalCells = xRes*yRes*zRes;
 
-        if (totalCells <= 0)
+        if (totalCells <= 0) {
+            fclose(file);
             return;
+        }
 
-        // write data
+        // write data, x-outer, one x slice per fwrite. ArrayGrid3D reads it back z-outer, so
+        // a cubic grid comes back with x and z swapped; F3D v2 doesn't do this.
+        vector<double> slice((size_t) yRes * zRes);
         for (uint i = 0; i < xRes; ++i) {
             for (uint j = 0; j < yRes; ++j) {
                 for (uint k = 0; k < zRes; ++k) {
-                    const Real val = get(i, j, k);
-                    double out;
-                    if (sizeof(Real) != sizeof(double)) {
-                        out = (double) val;
-                    } else {
-                        out = val;
-                    }
-
-                    fwrite((void*) (&out), sizeof(double), 1, file);
-
+                    slice[(size_t) j * zRes + k] = (double) get(i, j, k);
                 }
             }
+            fwrite((void*) slice.data(), sizeof(double), slice.size(), file);
 
             if (verbose && i % 10 == 0) {
                 PB_PROGRESS((Real) i / xRes);
             }
         }
+        fclose(file);
 
         if (verbose) {
             PB_END();
         }
     }
+
+    // Writes to a bricked, compressed F3D v2 file (see F3D2File), using the field bounds if
+    // the field has them, otherwise using the resolution of the grid.
+    void writeF3D2(string filename, bool verbose = false, F3D2File::DTYPE dtype = F3D2File::FLOAT64, Real band = 0) const {
+        F3D2File::write(filename, *this, hasMapBox ? mapBox : AABB(VEC3F(0,0,0), VEC3F(xRes, yRes, zRes)), verbose, dtype, band);
+    }
 };
 
+inline void F3D2File::write(const string& filename, const Grid3D& grid, const AABB& bounds, bool verbose, uint32_t dtype, Real band, uint32_t brickSize) {
+    if (dtype == INT16 && band <= 0) {
+        #pragma omp parallel for reduction(max:band)
+        for (uint z = 0; z < grid.zRes; z++) {
+            vector<Real> row(grid.xRes);
+            for (uint y = 0; y < grid.yRes; y++) {
+                grid.getRow(y, z, row.data());
+                for (Real v : row) band = max(band, fabs(v));
+            }
+        }
+        if (band <= 0) band = 1;
+    }
+
+    Writer writer(filename, grid.xRes, grid.yRes, grid.zRes, bounds, dtype, band, brickSize);
+    const uint64_t numBricks = writer.numBricks();
+
+    PB_DECL();
+    if (verbose) {
+        PB_STARTD("Compressing %dx%dx%d field into %lu bricks", grid.xRes, grid.yRes, grid.zRes, (unsigned long) numBricks);
+    }
+
+    vector<vector<char>> payloads(numBricks);
+    vector<uint32_t> codecs(numBricks);
+    size_t done = 0;
+
+    #pragma omp parallel for schedule(dynamic)
+    for (uint64_t b = 0; b < numBricks; b++) {
+        const VEC3I o = writer.brickOrigin(b);
+        const VEC3I d = writer.brickDims(b);
+
+        vector<Real> row(d.x());
+        vector<double> values((size_t) d.prod());
+        for (int z = 0; z < d.z(); z++) {
+            for (int y = 0; y < d.y(); y++) {
+                grid.getRowSpan(o.x(), d.x(), o.y() + y, o.z() + z, row.data());
+                copy(row.begin(), row.end(), values.begin() + ((size_t) z * d.y() + y) * d.x());
+            }
+        }
+        codecs[b] = encodeBrick(values.data(), values.size(), dtype, band, payloads[b]);
+
+        if (verbose) {
+            #pragma omp critical
+            {
+                if (++done % 64 == 0) {
+                    PB_PROGRESS((Real) done / numBricks);
+                }
+            }
+        }
+    }
+
+    for (uint64_t b = 0; b < numBricks; b++)
+        writer.writeBrick(b, payloads[b], codecs[b]);
+    const uint64_t bytes = writer.close();
+
+    if (verbose) {
+        PB_END();
+        printf("Wrote %s: %.2f MB, %.2fx smaller than raw doubles\n", filename.c_str(), bytes / pow(2.0, 20.0),
+            (double) grid.xRes * grid.yRes * grid.zRes * sizeof(double) / bytes);
+    }
+}
+
 class ArrayGrid3D: public Grid3D {
+public:
+    // How cells are ordered in memory. The bricked layouts keep the 2x2x2 stencil of an
+    // interpolated lookup in a few cache lines instead of two planes far apart; MORTON orders
+    // each 8^3 brick in Z-order, so an even-aligned stencil is one 64-byte line. Bricks are
+    // in z-major order and padded out to whole bricks on the far faces.
+    enum LAYOUT {
+        LINEAR,   // (z * yRes + y) * xRes + x
+        BRICK4,   // 4^3 bricks, z-major inside
+        BRICK8,   // 8^3 bricks, z-major inside
+        MORTON    // 8^3 bricks, Z-order inside
+    };
+
+    static const char* layoutName(LAYOUT layout) {
+        switch (layout) {
+        case LINEAR: return "linear";
+        case BRICK4: return "brick4";
+        case BRICK8: return "brick8";
+        case MORTON: return "morton";
+        }
+        return "unknown";
+    }
+
+    // How each value is stored. INT16 covers [-band, band] in 65535 steps and clamps values
+    // beyond it, which for an SDF only loses detail far from the surface.
+    enum PRECISION {
+        DOUBLE,
+        FLOAT,
+        INT16
+    };
+
+    static const char* precisionName(PRECISION precision) {
+        switch (precision) {
+        case DOUBLE: return "double";
+        case FLOAT:  return "float";
+        case INT16:  return "int16";
+        }
+        return "unknown";
+    }
+
+    template <int BITS>
+    static size_t brickBase(uint x, uint y, uint z, size_t bricksX, size_t bricksY) {
+        return (((z >> BITS) * bricksY + (y >> BITS)) * bricksX + (x >> BITS)) << (3 * BITS);
+    }
+
+    template <int BITS>
+    static size_t brickedIndex(uint x, uint y, uint z, size_t bricksX, size_t bricksY) {
+        const uint mask = (1 << BITS) - 1;
+        return brickBase<BITS>(x, y, z, bricksX, bricksY) | (((((z & mask) << BITS) | (y & mask)) << BITS) | (x & mask));
+    }
+
+    static size_t mortonIndex(uint x, uint y, uint z, size_t bricksX, size_t bricksY) {
+        // the 3 low bits of v spread out to bits 0, 3 and 6
+        auto spread = [](uint v) { return (v & 1) | ((v & 2) << 2) | ((v & 4) << 4); };
+        return brickBase<3>(x, y, z, bricksX, bricksY) | spread(x) | (spread(y) << 1) | (spread(z) << 2);
+    }
+
+    // Storage index of (x, y, z) in a layout, for a grid with the given resolution and brick counts
+    static size_t layoutIndex(LAYOUT layout, uint x, uint y, uint z, uint xRes, uint yRes, size_t bricksX, size_t bricksY) {
+        switch (layout) {
+        case LINEAR: break;
+        case BRICK4: return brickedIndex<2>(x, y, z, bricksX, bricksY);
+        case BRICK8: return brickedIndex<3>(x, y, z, bricksX, bricksY);
+        case MORTON: return mortonIndex(x, y, z, bricksX, bricksY);
+        }
+        return ((size_t) z * yRes + y) * xRes + x;
+    }
+
 private:
-    Real* values;
+    Real* values = NULL;
+    float* floatValues = NULL;
+    int16_t* quantizedValues = NULL;
+    PRECISION precision = DOUBLE;
+    Real quantizationBand = 0, quantizationStep = 0;
+
+    LAYOUT layout = LINEAR;
+    size_t bricksX = 0, bricksY = 0;
+
+    size_t index(uint x, uint y, uint z) const {
+        return layoutIndex(layout, x, y, z, xRes, yRes, bricksX, bricksY);
+    }
+
+    // Value at storage index i
+    Real stored(size_t i) const {
+        switch (precision) {
+        case DOUBLE: break;
+        case FLOAT:  return floatValues[i];
+        case INT16:  return quantizedValues[i] * quantizationStep;
+        }
+        return mappedValues ? mappedValue(i) : values[i];
+    }
+
+    void freeStorage() {
+        if (mapping) munmap(mapping, mappingSize);
+        else delete[] values;
+        delete[] floatValues;
+        delete[] quantizedValues;
+        mapping = NULL;
+        mappedValues = NULL;
+        values = NULL;
+        floatValues = NULL;
+        quantizedValues = NULL;
+    }
+
+    // Set when the values are a read-only mapping of an F3D file instead of an array. The
+    // payload follows a 60-byte header, so it isn't 8-byte aligned and is read with memcpy.
+    const char* mappedValues = NULL;
+    void* mapping = NULL;
+    size_t mappingSize = 0;
+
+    Real mappedValue(size_t i) const {
+        double v;
+        memcpy(&v, mappedValues + i * sizeof(double), sizeof(double));
+        return v;
+    }
+
+    // Maps the payload of an F3D file whose header has been read, leaving the data pages to
+    // be faulted in on first use. MAP_SHARED lets processes reading the same file share the
+    // page cache copy.
+    void mapF3D(const string& filename, size_t headerBytes) {
+        const size_t payloadBytes = (size_t) xRes * yRes * zRes * sizeof(double);
+
+        int fd = open(filename.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            printf("Failed to map F3D %s: file open failed!\n", filename.c_str());
+            exit(1);
+        }
+        if ((size_t) st.st_size < headerBytes + payloadBytes) {
+            printf("Failed to map F3D %s: %d x %d x %d field needs %zu bytes, file has %zu!\n",
+                filename.c_str(), xRes, yRes, zRes, headerBytes + payloadBytes, (size_t) st.st_size);
+            exit(1);
+        }
+
+        mappingSize = headerBytes + payloadBytes;
+        mapping = mmap(NULL, mappingSize, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (mapping == MAP_FAILED) {
+            printf("Failed to map F3D %s: mmap of %zu bytes failed!\n", filename.c_str(), mappingSize);
+            exit(1);
+        }
+
+        // Interpolation lookups jump between z slices, so readahead mostly pulls in pages
+        // that aren't needed yet
+        madvise(mapping, mappingSize, MADV_RANDOM);
+        mappedValues = (const char*) mapping + headerBytes;
+        values = NULL;
+    }
+
+    // Decodes every brick of an F3D v2 file into the array
+    void readF3D2(const string& filename, bool verbose) {
+        F3D2File f3d(filename);
+        xRes = f3d.xRes;
+        yRes = f3d.yRes;
+        zRes = f3d.zRes;
+        values = new Real[(size_t) xRes * yRes * zRes];
+        setMapBox(AABB(f3d.center - f3d.lengths/2, f3d.center + f3d.lengths/2));
+
+        #pragma omp parallel for schedule(dynamic)
+        for (size_t b = 0; b < f3d.numBricks(); b++) {
+            const VEC3I o = f3d.brickOrigin(b), d = f3d.brickDims(b);
+            vector<Real> brick(d.prod());
+            f3d.readBrick(b, brick.data());
+            for (int z = 0; z < d.z(); z++)
+                for (int y = 0; y < d.y(); y++)
+                    copy_n(&brick[((size_t) z * d.y() + y) * d.x()], d.x(), &at(o.x(), o.y() + y, o.z() + z));
+        }
+
+        if (verbose) printf("Read %d x %d x %d field from F3D2 %s\n", xRes, yRes, zRes, filename.c_str());
+    }
+
 public:
 
     // Create empty (not zeroed) field with given resolution
@@ -408,10 +1118,14 @@ public:
     // Create empty (not zeroed) field with given resolution
     ArrayGrid3D(VEC3I resolution): ArrayGrid3D(resolution[0], resolution[1], resolution[2]) {}
 
-    // Read ArrayGrid3D from F3D
-    ArrayGrid3D(string filename, string format = "f3d", bool verbose = false) {
+    // Read ArrayGrid3D from F3D (v1, or v2 which is decoded whole). With memoryMap, a v1
+    // file is mapped read-only instead of read (at(), operator[] and atFieldPos must not be
+    // used to write to it then).
+    ArrayGrid3D(string filename, string format = "f3d", bool verbose = false, bool memoryMap = false) {
 
-        if (format == "f3d") {
+        if (format == "f3d" && F3D2File::isF3D2(filename)) {
+            readF3D2(filename, verbose);
+        } else if (format == "f3d") {
             FILE* file = fopen(filename.c_str(), "rb");
             if (file == NULL) {
                 PRINT("Failed to read F3D: file open failed!");
@@ -433,6 +1147,22 @@ public:
             this->yRes = yRes;
             this->zRes = zRes;
 
+            if (memoryMap) {
+                if (xRes <= 0 || yRes <= 0 || zRes <= 0 || !center.allFinite() || !lengths.allFinite() || lengths.minCoeff() <= 0) {
+                    printf("Failed to map F3D %s: bad header (res %d x %d x %d, lengths %f %f %f)!\n",
+                        filename.c_str(), xRes, yRes, zRes, lengths[0], lengths[1], lengths[2]);
+                    exit(1);
+                }
+
+                const size_t headerBytes = ftell(file);
+                fclose(file);
+                mapF3D(filename, headerBytes);
+                setMapBox(AABB(center - lengths/2, center + lengths/2));
+
+                if (verbose) printf("Mapped %d x %d x %d field from %s\n", xRes, yRes, zRes, filename.c_str());
+                return;
+            }
+
             try {
                 values = new Real[xRes * yRes * zRes];
             } catch(bad_alloc& exc) {
@@ -466,6 +1196,8 @@ public:
                 printf("done.\n");
             }
 
+            fclose(file);
+
         } else {
             PRINT("CSV import not implemented yet!");
             exit(1);
@@ -474,17 +1206,132 @@ public:
     }
     // Destructor
     ~ArrayGrid3D() {
-        delete values;
+        freeStorage();
+    }
+
+    bool isMapped() const { return mapping != NULL; }
+
+    LAYOUT getLayout() const { return layout; }
+    PRECISION getPrecision() const { return precision; }
+    Real getQuantizationBand() const { return quantizationBand; }
+
+    // Number of stored values, including the padding of bricked layouts
+    size_t storageCells() const {
+        if (layout == LINEAR) return (size_t) xRes * yRes * zRes;
+        const int bits = (layout == BRICK4) ? 2 : 3;
+        return (bricksX * bricksY * ((zRes + (1 << bits) - 1) >> bits)) << (3 * bits);
+    }
+
+    size_t storageBytes() const {
+        const size_t bytes[] = { sizeof(Real), sizeof(float), sizeof(int16_t) };
+        return storageCells() * bytes[precision];
+    }
+
+    // Converts the values to the given precision (a mapped grid is copied into memory). For
+    // INT16, band = 0 picks the largest magnitude in the grid, so nothing is clamped.
+    void setPrecision(PRECISION newPrecision, Real band = 0) {
+        if (newPrecision == precision && newPrecision != INT16 && !mapping) return;
+
+        const size_t n = storageCells();
+        if (newPrecision == INT16 && band <= 0) {
+            for (size_t i = 0; i < n; i++) band = max(band, fabs(stored(i)));
+            if (band <= 0) band = 1;
+        }
+
+        Real* newValues = NULL;
+        float* newFloats = NULL;
+        int16_t* newQuantized = NULL;
+        const Real step = band / 32767;
+        switch (newPrecision) {
+        case DOUBLE:
+            newValues = new Real[n];
+            for (size_t i = 0; i < n; i++) newValues[i] = stored(i);
+            break;
+        case FLOAT:
+            newFloats = new float[n];
+            for (size_t i = 0; i < n; i++) newFloats[i] = stored(i);
+            break;
+        case INT16:
+            newQuantized = new int16_t[n];
+            for (size_t i = 0; i < n; i++) newQuantized[i] = lrint(min(band, max(-band, stored(i))) / step);
+            break;
+        }
+
+        freeStorage();
+        values = newValues;
+        floatValues = newFloats;
+        quantizedValues = newQuantized;
+        precision = newPrecision;
+        quantizationBand = (newPrecision == INT16) ? band : 0;
+        quantizationStep = (newPrecision == INT16) ? step : 0;
+    }
+
+    // Reorders the values into the given layout (a mapped grid is copied into memory)
+    void setLayout(LAYOUT newLayout) {
+        if (newLayout == layout && !mapping) return;
+
+        if (precision != DOUBLE) {
+            const PRECISION oldPrecision = precision;
+            const Real band = quantizationBand;
+            setPrecision(DOUBLE);
+            setLayout(newLayout);
+            setPrecision(oldPrecision, band);
+            return;
+        }
+
+        const int bits = (newLayout == BRICK4) ? 2 : 3;
+        const size_t newBricksX = (xRes + (1 << bits) - 1) >> bits;
+        const size_t newBricksY = (yRes + (1 << bits) - 1) >> bits;
+        const size_t newBricksZ = (zRes + (1 << bits) - 1) >> bits;
+        const size_t size = (newLayout == LINEAR) ? (size_t) xRes * yRes * zRes : (newBricksX * newBricksY * newBricksZ) << (3 * bits);
+
+        Real* reordered = new Real[size];
+        fill(reordered, reordered + size, 0);
+
+        vector<Real> row(xRes);
+        for (uint z = 0; z < zRes; z++) {
+            for (uint y = 0; y < yRes; y++) {
+                getRow(y, z, row.data());
+                for (uint x = 0; x < xRes; x++)
+                    reordered[layoutIndex(newLayout, x, y, z, xRes, yRes, newBricksX, newBricksY)] = row[x];
+            }
+        }
+
+        freeStorage();
+        values = reordered;
+        layout = newLayout;
+        bricksX = newBricksX;
+        bricksY = newBricksY;
     }
 
     // Access value based on integer indices
     Real get(uint x, uint y, uint z) const override {
-        return values[(z * yRes + y) * xRes + x];
+        return stored(index(x, y, z));
     }
 
-    // Access value directly (allows setting)
+    void getRowSpan(uint x0, uint n, uint y, uint z, Real* out) const override {
+        if (layout != LINEAR || precision != DOUBLE || mappedValues) {
+            for (uint k = 0; k < n; k++) out[k] = stored(index(x0 + k, y, z));
+            return;
+        }
+        const Real* row = values + ((size_t) z * yRes + y) * xRes + x0;
+        copy(row, row + n, out);
+    }
+
+    // The values in storage order (see layoutIndex), or NULL unless they are doubles in memory
+    const Real* doubleValues() const {
+        return (precision == DOUBLE && !mappedValues) ? values : NULL;
+    }
+
+    // Bricks along x and y of the bricked layouts, which layoutIndex needs
+    size_t getBricksX() const { return bricksX; }
+    size_t getBricksY() const { return bricksY; }
+
+    // Access value directly (allows setting). Only for DOUBLE grids that aren't mapped, as
+    // are operator[] and atFieldPos.
     Real& at(uint x, uint y, uint z) {
-        return values[(z * yRes + y) * xRes + x];
+        assert(precision == DOUBLE && !mappedValues);
+        return values[index(x, y, z)];
     }
 
     Real& atFieldPos(VEC3F pos) {
@@ -510,8 +1357,10 @@ public:
         return atFieldPos(pos);
     }
 
-    // Access value directly in C-style array (allows setting)
+    // Access value directly in C-style array (allows setting), in storage order, which is
+    // only (z * yRes + y) * xRes + x for the LINEAR layout
     Real& operator[](size_t x) {
+        assert(precision == DOUBLE && !mappedValues);
         return values[x];
     }
 
@@ -520,35 +1369,317 @@ public:
     ArrayGrid3D(uint xRes, uint yRes, uint zRes, VEC3F functionMin, VEC3F functionMax, FieldFunction3D *fieldFunction):ArrayGrid3D(xRes, yRes, zRes){
 
         VEC3F gridResF(xRes, yRes, zRes);
+        VEC3F fieldDelta = functionMax - functionMin;
 
         PB_START("Sampling %dx%dx%d scalar field into ArrayGrid3D", xRes, yRes, zRes);
 
-        for (uint i = 0; i < xRes; i++) {
+        // Rows along x are contiguous in memory, so each one is filled by a single batch
+        vector<VEC3F> samplePoints(xRes);
+        for (uint k = 0; k < zRes; k++) {
             for (uint j = 0; j < yRes; j++) {
-                for (uint k = 0; k < zRes; k++) {
+                for (uint i = 0; i < xRes; i++) {
                     VEC3F gridPointF(i, j, k);
-                    VEC3F fieldDelta = functionMax - functionMin;
+                    samplePoints[i] = functionMin + (gridPointF.cwiseQuotient(gridResF - VEC3F(1,1,1)).cwiseProduct(fieldDelta));
+                }
+
+                fieldFunction->getFieldValues(samplePoints.data(), &this->at(0, j, k), xRes);
+            }
+            PB_PROGRESS((Real) k / zRes);
+        }
+        PB_END();
+
+        this->setMapBox(AABB(functionMin, functionMax));
+
+    }
+
+
+};
+
+/*
+   Grid over an F3D v2 file that decodes each brick the first time it is touched, so only the
+   parts of the field that are sampled are read and kept in memory. Lookups are thread-safe:
+   threads racing to decode the same brick each decode it, and one copy is kept.
+*/
+class F3DBrickGrid: public Grid3D {
+private:
+    F3D2File f3d;
+    mutable vector<atomic<Real*>> bricks;
+    mutable atomic<size_t> bricksLoaded;
+
+    const Real* brick(size_t b) const {
+        Real* data = bricks[b].load(memory_order_acquire);
+        if (data) return data;
+
+        Real* decoded = new Real[f3d.brickDims(b).prod()];
+        f3d.readBrick(b, decoded);
+        if (bricks[b].compare_exchange_strong(data, decoded, memory_order_acq_rel)) {
+            bricksLoaded++;
+            return decoded;
+        }
+        delete[] decoded;
+        return data;
+    }
+
+public:
+    F3DBrickGrid(const string& filename): f3d(filename), bricks(f3d.numBricks()), bricksLoaded(0) {
+        xRes = f3d.xRes;
+        yRes = f3d.yRes;
+        zRes = f3d.zRes;
+        for (atomic<Real*>& b : bricks) b.store(NULL);
+        setMapBox(AABB(f3d.center - f3d.lengths/2, f3d.center + f3d.lengths/2));
+    }
+
+    ~F3DBrickGrid() {
+        for (atomic<Real*>& b : bricks) delete[] b.load();
+    }
 
-                    VEC3F samplePoint = functionMin + (gridPointF.cwiseQuotient(gridResF - VEC3F(1,1,1)).cwiseProduct(fieldDelta));
+    size_t numBricks() const { return bricks.size(); }
+    size_t numBricksLoaded() const { return bricksLoaded; }
 
-                    Real val = fieldFunction->getFieldValue(samplePoint);
+    // Frees every decoded brick; they are decoded again on their next lookup. Not safe
+    // while other threads are sampling the grid.
+    void releaseBricks() {
+        for (atomic<Real*>& b : bricks) delete[] b.exchange(NULL);
+        bricksLoaded = 0;
+    }
+
+    Real get(uint x, uint y, uint z) const override {
+        const uint s = f3d.brickSize;
+        const size_t b = f3d.brickIndex(x / s, y / s, z / s);
+        const VEC3I o = f3d.brickOrigin(b), d = f3d.brickDims(b);
+        return brick(b)[((size_t) (z - o.z()) * d.y() + (y - o.y())) * d.x() + (x - o.x())];
+    }
+
+    void getRowSpan(uint x0, uint n, uint y, uint z, Real* out) const override {
+        const uint s = f3d.brickSize;
+        for (uint x = x0; x < x0 + n;) {
+            const size_t b = f3d.brickIndex(x / s, y / s, z / s);
+            const VEC3I o = f3d.brickOrigin(b), d = f3d.brickDims(b);
+            const uint count = min<uint>(x0 + n - x, o.x() + d.x() - x);
+            const Real* row = brick(b) + ((size_t) (z - o.z()) * d.y() + (y - o.y())) * d.x() + (x - o.x());
+            copy(row, row + count, out + (x - x0));
+            x += count;
+        }
+    }
+};
+
+// Narrow-band grid in the spirit of VDB: exact values are kept only in 8^3 leaves that have a
+// value within [bandMin, bandMax], and every other leaf is a single constant. Leaves are grouped
+// into nodes of 16^3 leaves, and a node without any exact leaf collapses to a constant as
+// well, so memory scales with the area of the band surface rather than the volume. The
+// constant of a tile is the mean of its values. The top level is a flat table of nodes
+// since the grid is bounded.
+class SparseGrid3D: public Grid3D {
+public:
+    static constexpr uint leafBits = 3;
+    static constexpr uint nodeBits = 4;
 
-                    this->at(i, j, k) = val;
+private:
+    static constexpr uint leafSize = 1 << leafBits;
+    static constexpr uint leafCells = 1 << (3 * leafBits);
+    static constexpr uint nodeLeaves = 1 << (3 * nodeBits);
+    static constexpr uint nodeShift = leafBits + nodeBits;
+
+    struct Node {
+        int32_t leaf[nodeLeaves];    // index into values / leafCells, or -1 for a constant tile
+        Real tile[nodeLeaves];
+        vector<Real> values;
+    };
+
+    Real bandMin, bandMax;
+    uint nodesX, nodesY, nodesZ;
+    vector<Node*> nodes;
+    vector<Real> nodeTiles;
+    size_t leafCount;
+
+    size_t nodeIndex(uint x, uint y, uint z) const {
+        return ((size_t) (z >> nodeShift) * nodesY + (y >> nodeShift)) * nodesX + (x >> nodeShift);
+    }
+
+    static uint leafSlot(uint x, uint y, uint z) {
+        const uint m = (1 << nodeBits) - 1;
+        return ((((z >> leafBits) & m) << nodeBits | ((y >> leafBits) & m)) << nodeBits) | ((x >> leafBits) & m);
+    }
+
+    static uint cellSlot(uint x, uint y, uint z) {
+        const uint m = leafSize - 1;
+        return (((z & m) << leafBits | (y & m)) << leafBits) | (x & m);
+    }
+
+    // Builds the node at (nx, ny, nz) from the source, or returns NULL and its constant in
+    // tile if none of its leaves reach the band. A leaf is exact if any value in it or in the
+    // one-voxel shell around it is in the band, so trilinear lookups with any corner in the
+    // band only blend exact values.
+    Node* buildNode(const Grid3D& source, uint nx, uint ny, uint nz, Real& tile) const {
+        Node* node = new Node;
+        vector<Real> row(leafSize + 2);
+        vector<Real> leafValues(leafCells);
+
+        Real nodeSum = 0;
+        size_t nodeCount = 0;
+        for (uint slot = 0; slot < nodeLeaves; slot++) {
+            const uint s = (1 << nodeBits) - 1;
+            const uint x0 = ((nx << nodeBits) + (slot & s)) << leafBits;
+            const uint y0 = ((ny << nodeBits) + ((slot >> nodeBits) & s)) << leafBits;
+            const uint z0 = ((nz << nodeBits) + (slot >> (2 * nodeBits))) << leafBits;
+            node->leaf[slot] = -1;
+            node->tile[slot] = 0;
+            if (x0 >= xRes || y0 >= yRes || z0 >= zRes) continue;
+
+            const uint xa = (x0 > 0) ? x0 - 1 : 0, xb = min(x0 + leafSize, xRes - 1);
+            const uint ya = (y0 > 0) ? y0 - 1 : 0, yb = min(y0 + leafSize, yRes - 1);
+            const uint za = (z0 > 0) ? z0 - 1 : 0, zb = min(z0 + leafSize, zRes - 1);
+
+            bool exact = false;
+            Real sum = 0;
+            uint count = 0;
+            fill(leafValues.begin(), leafValues.end(), 0);
+            for (uint z = za; z <= zb; z++) {
+                for (uint y = ya; y <= yb; y++) {
+                    source.getRowSpan(xa, xb - xa + 1, y, z, row.data());
+                    const bool inLeaf = z >= z0 && z < z0 + leafSize && y >= y0 && y < y0 + leafSize;
+                    for (uint x = xa; x <= xb; x++) {
+                        const Real v = row[x - xa];
+                        exact |= (v >= bandMin && v <= bandMax);
+                        if (!inLeaf || x < x0 || x >= x0 + leafSize) continue;
+                        leafValues[cellSlot(x, y, z)] = v;
+                        sum += v;
+                        count++;
+                    }
                 }
             }
-            PB_PROGRESS((Real) i / xRes);
+
+            node->tile[slot] = sum / count;
+            nodeSum += sum;
+            nodeCount += count;
+            if (exact) {
+                node->leaf[slot] = node->values.size() / leafCells;
+                node->values.insert(node->values.end(), leafValues.begin(), leafValues.end());
+            }
         }
-        PB_END();
 
-        this->setMapBox(AABB(functionMin, functionMax));
+        tile = nodeSum / nodeCount;
+        if (node->values.empty()) {
+            delete node;
+            return NULL;
+        }
+        node->values.shrink_to_fit();
+        return node;
+    }
+
+    // Builds the nodes one 128-voxel z slab at a time, calling afterSlab between slabs
+    template<typename AfterSlab>
+    void build(const Grid3D& source, bool verbose, AfterSlab afterSlab) {
+        xRes = source.xRes;
+        yRes = source.yRes;
+        zRes = source.zRes;
+        nodesX = (xRes + (1 << nodeShift) - 1) >> nodeShift;
+        nodesY = (yRes + (1 << nodeShift) - 1) >> nodeShift;
+        nodesZ = (zRes + (1 << nodeShift) - 1) >> nodeShift;
+        nodes.assign((size_t) nodesX * nodesY * nodesZ, NULL);
+        nodeTiles.assign(nodes.size(), 0);
+        leafCount = 0;
+        if (source.hasMapBox) setMapBox(source.mapBox);
+
+        PB_DECL();
+        if (verbose) {
+            PB_STARTD("Building %dx%dx%d narrow-band grid over [%g, %g]", xRes, yRes, zRes, bandMin, bandMax);
+        }
+
+        const size_t slabNodes = (size_t) nodesX * nodesY;
+        for (uint nz = 0; nz < nodesZ; nz++) {
+            size_t leaves = 0;
+            #pragma omp parallel for schedule(dynamic) reduction(+:leaves)
+            for (size_t i = 0; i < slabNodes; i++) {
+                const size_t n = nz * slabNodes + i;
+                nodes[n] = buildNode(source, i % nodesX, i / nodesX, nz, nodeTiles[n]);
+                if (nodes[n]) leaves += nodes[n]->values.size() / leafCells;
+            }
+            leafCount += leaves;
+            afterSlab();
+            if (verbose) {
+                PB_PROGRESS((Real) (nz + 1) / nodesZ);
+            }
+        }
 
+        if (verbose) {
+            PB_END();
+            printf("%lu of %lu leaves exact, %.1f MB (dense: %.1f MB)\n", (unsigned long) leafCount,
+                (unsigned long) numLeaves(), memoryBytes() / pow(2.0, 20.0), (double) xRes * yRes * zRes * sizeof(Real) / pow(2.0, 20.0));
+        }
     }
 
+public:
+    // Samples the band of any grid, e.g. an ArrayGrid3D or F3DBrickGrid
+    SparseGrid3D(const Grid3D& source, Real bandMin, Real bandMax, bool verbose = false): bandMin(bandMin), bandMax(bandMax) {
+        build(source, verbose, [] {});
+    }
+
+    // Reads the band of an F3D file (v1 or v2) without holding the whole file in memory:
+    // v1 files are mapped, and v2 bricks are freed after each slab of nodes.
+    SparseGrid3D(const string& filename, Real bandMin, Real bandMax, bool verbose = false): bandMin(bandMin), bandMax(bandMax) {
+        if (F3D2File::isF3D2(filename)) {
+            F3DBrickGrid source(filename);
+            build(source, verbose, [&] { source.releaseBricks(); });
+        } else {
+            ArrayGrid3D source(filename, "f3d", false, true);
+            build(source, verbose, [] {});
+        }
+    }
+
+    SparseGrid3D(const SparseGrid3D&) = delete;
+    SparseGrid3D& operator=(const SparseGrid3D&) = delete;
+
+    ~SparseGrid3D() {
+        for (Node* n : nodes) delete n;
+    }
+
+    Real getBandMin() const { return bandMin; }
+    Real getBandMax() const { return bandMax; }
+
+    size_t numLeaves() const {
+        return (size_t) ((xRes + leafSize - 1) >> leafBits) * ((yRes + leafSize - 1) >> leafBits) * ((zRes + leafSize - 1) >> leafBits);
+    }
+    size_t numExactLeaves() const { return leafCount; }
+
+    size_t memoryBytes() const {
+        size_t bytes = nodes.size() * (sizeof(Node*) + sizeof(Real));
+        for (const Node* n : nodes) {
+            if (n) bytes += sizeof(Node) + n->values.capacity() * sizeof(Real);
+        }
+        return bytes;
+    }
 
+    Real get(uint x, uint y, uint z) const override {
+        const size_t n = nodeIndex(x, y, z);
+        const Node* node = nodes[n];
+        if (!node) return nodeTiles[n];
+
+        const uint slot = leafSlot(x, y, z);
+        const int32_t leaf = node->leaf[slot];
+        if (leaf < 0) return node->tile[slot];
+        return node->values[(size_t) leaf * leafCells + cellSlot(x, y, z)];
+    }
+
+    void getRowSpan(uint x0, uint n, uint y, uint z, Real* out) const override {
+        for (uint x = x0; x < x0 + n;) {
+            const uint count = min(x0 + n - x, leafSize - (x & (leafSize - 1)));
+            const size_t ni = nodeIndex(x, y, z);
+            const Node* node = nodes[ni];
+            const int32_t leaf = node ? node->leaf[leafSlot(x, y, z)] : -1;
+            if (leaf >= 0) {
+                const Real* row = &node->values[(size_t) leaf * leafCells + cellSlot(x, y, z)];
+                copy(row, row + count, out + (x - x0));
+            } else {
+                fill(out + (x - x0), out + (x - x0) + count, node ? node->tile[leafSlot(x, y, z)] : nodeTiles[ni]);
+            }
+            x += count;
+        }
+    }
 };
 
 class VirtualGrid3D: public Grid3D {
-private:
+protected:
     FieldFunction3D *fieldFunction;
     VEC3F functionMin, functionMax;
 
@@ -605,6 +1736,22 @@ public:
     virtual Real getf(Real x, Real y, Real z) const override {
         return fieldFunction->getFieldValue(getSamplePoint(x, y, z));
     }
+
+    virtual void getRowSpan(uint x0, uint n, uint y, uint z, Real* out) const override {
+        vector<VEC3F> samplePoints(n);
+        for (uint i = 0; i < n; ++i) {
+            samplePoints[i] = getSamplePoint(x0 + i, y, z);
+        }
+        fieldFunction->getFieldValues(samplePoints.data(), out, n);
+    }
+
+    virtual void getfValues(const VEC3F* indices, Real* out, size_t n) const override {
+        vector<VEC3F> samplePoints(n);
+        for (size_t i = 0; i < n; ++i) {
+            samplePoints[i] = getSamplePoint(indices[i][0], indices[i][1], indices[i][2]);
+        }
+        fieldFunction->getFieldValues(samplePoints.data(), out, n);
+    }
 };
 
 // Hash function for Eigen matrix and vector.
@@ -635,49 +1782,17 @@ public:
 
     using VirtualGrid3D::VirtualGrid3D;
 
-    virtual Real get(uint x, uint y, uint z) const override {
-        return getf(x,y,z);
+    virtual bool supportsConcurrentQueries() const override {
+        return false;
     }
 
-    virtual Real getf(Real x, Real y, Real z) const override {
-        VEC3F key(x,y,z);
-        numQueries++;
-
-        auto search = map.find(key);
-        if (search != map.end()) {
-            numHits++;
-            return search->second;
-        }
-
-        Real result = VirtualGrid3D::get(x,y,z);
-        map[key] = result;
-        numMisses++;
-        return result;
+    virtual void getRowSpan(uint x0, uint n, uint y, uint z, Real* out) const override {
+        Grid3D::getRowSpan(x0, n, y, z, out);
     }
 
-};
-
-class VirtualGrid3DLimitedCache: public VirtualGrid3DCached {
-private:
-    size_t maxSize;
-    mutable queue<VEC3F> cacheQueue;
-
-public:
-    // Instantiates a VirtualGrid3D with a limited-size cache. When additional
-    // items are inserted into the cache (beyond the capacity), the cache will
-    // forget the item that was least recently inserted. If capacity -1 is
-    // specified (default), it defaults to a size equal to three XY slices
-    // through the field, which is suited for marching cubes.
-    VirtualGrid3DLimitedCache(uint xRes, uint yRes, uint zRes, VEC3F functionMin, VEC3F functionMax,  FieldFunction3D *fieldFunction, int capacity = -1):
-        VirtualGrid3DCached(xRes, yRes, zRes, functionMin, functionMax, fieldFunction) {
-            PRINTV3(functionMin);
-            PRINTV3(functionMax);
-            if (capacity == -1) {
-                maxSize = xRes * yRes * 3;
-            } else {
-                maxSize = capacity;
-            }
-        }
+    virtual void getfValues(const VEC3F* indices, Real* out, size_t n) const override {
+        Grid3D::getfValues(indices, out, n);
+    }
 
     virtual Real get(uint x, uint y, uint z) const override {
         return getf(x,y,z);
@@ -693,23 +1808,21 @@ public:
             return search->second;
         }
 
-        // We need to insert another value
-        if (cacheQueue.size() >= maxSize) {
-            map.erase(cacheQueue.front());
-            cacheQueue.pop();
-        }
-
-        Real result = VirtualGrid3D::getf(x,y,z);
+        Real result = VirtualGrid3D::get(x,y,z);
         map[key] = result;
-        cacheQueue.push(key);
-
         numMisses++;
         return result;
     }
-};
 
+};
 
 class InterpolationGrid: public Grid3D {
+public:
+    enum INTERPOLATION_MODE {
+        LINEAR,
+        SMOOTHSTEP
+    };
+
 private:
     Real interpolate(Real x0, Real x1, Real d) const {
         switch (mode) {
@@ -723,15 +1836,155 @@ private:
         return -1;
     }
 
+    // Everything the fused lookup over a DOUBLE ArrayGrid3D needs: field position to grid
+    // index is (pos - origin) * scale, clamped to [0, last].
+    struct Trilinear {
+        const Real* values;
+        Real originX, originY, originZ;
+        Real scaleX, scaleY, scaleZ;
+        Real lastX, lastY, lastZ;
+        size_t rowStride, sliceStride;
+        ArrayGrid3D::LAYOUT layout;
+        size_t bricksX, bricksY;
+    };
+
+    const ArrayGrid3D* arrayBase = NULL;
+    Trilinear trilinear;
+    AABB trilinearBox;
+
+    template<INTERPOLATION_MODE M>
+    static inline Real lerp(Real x0, Real x1, Real d) {
+        if (M == SMOOTHSTEP) d = (3 * d * d) - (2 * d * d * d);
+        return ((1 - d) * x0) + (d * x1);
+    }
+
+    // Same blend as getf, with the corners read straight from the array in layout L
+    template<INTERPOLATION_MODE M, ArrayGrid3D::LAYOUT L>
+    static inline Real sample(const Trilinear& t, Real px, Real py, Real pz) {
+        const Real x = min(t.lastX, max((Real) 0, (px - t.originX) * t.scaleX));
+        const Real y = min(t.lastY, max((Real) 0, (py - t.originY) * t.scaleY));
+        const Real z = min(t.lastZ, max((Real) 0, (pz - t.originZ) * t.scaleZ));
+
+        const int x0 = x, y0 = y, z0 = z;
+        const Real xd = x - x0, yd = y - y0, zd = z - z0;
+
+        // On the far faces the upper corner is clamped to the lower one. Every layout's index
+        // is a sum of separate x, y and z terms, so the corners are offsets from the lower one.
+        size_t base, dx, dy, dz;
+        if (L == ArrayGrid3D::LINEAR) {
+            dx = (x0 < t.lastX) ? 1 : 0;
+            dy = (y0 < t.lastY) ? t.rowStride : 0;
+            dz = (z0 < t.lastZ) ? t.sliceStride : 0;
+            base = z0 * t.sliceStride + y0 * t.rowStride + x0;
+        } else {
+            auto index = [&](uint cx, uint cy, uint cz) {
+                return ArrayGrid3D::layoutIndex(L, cx, cy, cz, t.rowStride, 0, t.bricksX, t.bricksY);
+            };
+            base = index(x0, y0, z0);
+            dx = (x0 < t.lastX) ? index(x0 + 1, 0, 0) - index(x0, 0, 0) : 0;
+            dy = (y0 < t.lastY) ? index(0, y0 + 1, 0) - index(0, y0, 0) : 0;
+            dz = (z0 < t.lastZ) ? index(0, 0, z0 + 1) - index(0, 0, z0) : 0;
+        }
+        const Real* c = t.values + base;
+
+        const Real c00 = lerp<M>(c[0],       c[dx],           xd);
+        const Real c01 = lerp<M>(c[dz],      c[dz + dx],      xd);
+        const Real c10 = lerp<M>(c[dy],      c[dy + dx],      xd);
+        const Real c11 = lerp<M>(c[dz + dy], c[dz + dy + dx], xd);
+
+        const Real c0 = lerp<M>(c00, c10, yd);
+        const Real c1 = lerp<M>(c01, c11, yd);
+
+        return lerp<M>(c0, c1, zd);
+    }
+
+    template<INTERPOLATION_MODE M>
+    static inline Real sampleLayout(const Trilinear& t, Real px, Real py, Real pz) {
+        switch (t.layout) {
+        case ArrayGrid3D::LINEAR: break;
+        case ArrayGrid3D::BRICK4: return sample<M, ArrayGrid3D::BRICK4>(t, px, py, pz);
+        case ArrayGrid3D::BRICK8: return sample<M, ArrayGrid3D::BRICK8>(t, px, py, pz);
+        case ArrayGrid3D::MORTON: return sample<M, ArrayGrid3D::MORTON>(t, px, py, pz);
+        }
+        return sample<M, ArrayGrid3D::LINEAR>(t, px, py, pz);
+    }
+
+    template<INTERPOLATION_MODE M, ArrayGrid3D::LAYOUT L>
+    static inline void sampleBatch(const Trilinear& t, const VEC3F* pos, Real* out, size_t n) {
+        #pragma omp simd
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = sample<M, L>(t, pos[i][0], pos[i][1], pos[i][2]);
+        }
+    }
+
+    // ISA-specific clones of the batch, picked at runtime. FMA contraction is kept off (AVX-512F
+    // has its own FMAs) so that every clone rounds exactly like the scalar lookup.
+#if defined(__GNUC__) && defined(__x86_64__)
+    template<INTERPOLATION_MODE M, ArrayGrid3D::LAYOUT L>
+    __attribute__((target("avx2"))) static void sampleBatchAVX2(const Trilinear& t, const VEC3F* pos, Real* out, size_t n) {
+        sampleBatch<M, L>(t, pos, out, n);
+    }
+
+    template<INTERPOLATION_MODE M, ArrayGrid3D::LAYOUT L>
+    __attribute__((target("avx512f"), optimize("fp-contract=off"))) static void sampleBatchAVX512(const Trilinear& t, const VEC3F* pos, Real* out, size_t n) {
+        sampleBatch<M, L>(t, pos, out, n);
+    }
+
+    enum BATCH_ISA { GENERIC, AVX2, AVX512 };
+
+    static BATCH_ISA batchISA() {
+        static const BATCH_ISA isa = [] {
+            __builtin_cpu_init();
+            if (__builtin_cpu_supports("avx512f")) return AVX512;
+            if (__builtin_cpu_supports("avx2")) return AVX2;
+            return GENERIC;
+        }();
+        return isa;
+    }
+
+    template<INTERPOLATION_MODE M, ArrayGrid3D::LAYOUT L>
+    static void sampleBatchDispatch(const Trilinear& t, const VEC3F* pos, Real* out, size_t n) {
+        switch (batchISA()) {
+        case AVX512: sampleBatchAVX512<M, L>(t, pos, out, n); return;
+        case AVX2:   sampleBatchAVX2<M, L>(t, pos, out, n);   return;
+        case GENERIC: break;
+        }
+        sampleBatch<M, L>(t, pos, out, n);
+    }
+#else
+    template<INTERPOLATION_MODE M, ArrayGrid3D::LAYOUT L>
+    static void sampleBatchDispatch(const Trilinear& t, const VEC3F* pos, Real* out, size_t n) {
+        sampleBatch<M, L>(t, pos, out, n);
+    }
+#endif
+
+    template<INTERPOLATION_MODE M>
+    static void sampleBatchLayout(const Trilinear& t, const VEC3F* pos, Real* out, size_t n) {
+        switch (t.layout) {
+        case ArrayGrid3D::LINEAR: break;
+        case ArrayGrid3D::BRICK4: sampleBatchDispatch<M, ArrayGrid3D::BRICK4>(t, pos, out, n); return;
+        case ArrayGrid3D::BRICK8: sampleBatchDispatch<M, ArrayGrid3D::BRICK8>(t, pos, out, n); return;
+        case ArrayGrid3D::MORTON: sampleBatchDispatch<M, ArrayGrid3D::MORTON>(t, pos, out, n); return;
+        }
+        sampleBatchDispatch<M, ArrayGrid3D::LINEAR>(t, pos, out, n);
+    }
+
+    // The fused lookup applies while the base ArrayGrid3D holds doubles in memory (in any
+    // layout) and mapBox is still the box passed to setMapBox (main and others assign it directly).
+    bool fastPath(Trilinear& t) const {
+        if (!arrayBase || !hasMapBox) return false;
+        if (mapBox.min() != trilinearBox.min() || mapBox.max() != trilinearBox.max()) return false;
+        t = trilinear;
+        t.values = arrayBase->doubleValues();
+        t.layout = arrayBase->getLayout();
+        t.bricksX = arrayBase->getBricksX();
+        t.bricksY = arrayBase->getBricksY();
+        return t.values != NULL;
+    }
 
 public:
     Grid3D* baseGrid;
 
-    enum INTERPOLATION_MODE {
-        LINEAR,
-        SMOOTHSTEP
-    };
-
     INTERPOLATION_MODE mode;
 
     InterpolationGrid(Grid3D* baseGrid, INTERPOLATION_MODE mode = LINEAR) {
@@ -741,6 +1994,7 @@ public:
         zRes = baseGrid->zRes;
         this->mode = mode;
         this->supportsNonIntegerIndices = true;
+        arrayBase = dynamic_cast<const ArrayGrid3D*>(baseGrid);
 
         if (baseGrid->hasMapBox) this->setMapBox(baseGrid->mapBox);
 
@@ -749,10 +2003,50 @@ public:
         }
     }
 
+    virtual void setMapBox(AABB box) override {
+        Grid3D::setMapBox(box);
+
+        trilinearBox = box;
+        trilinear.originX = box.min()[0];
+        trilinear.originY = box.min()[1];
+        trilinear.originZ = box.min()[2];
+        trilinear.scaleX = (xRes - 1) / box.span()[0];
+        trilinear.scaleY = (yRes - 1) / box.span()[1];
+        trilinear.scaleZ = (zRes - 1) / box.span()[2];
+        trilinear.lastX = xRes - 1;
+        trilinear.lastY = yRes - 1;
+        trilinear.lastZ = zRes - 1;
+        trilinear.rowStride = xRes;
+        trilinear.sliceStride = (size_t) xRes * yRes;
+    }
+
+    virtual Real getFieldValue(const VEC3F& pos) const override {
+        Trilinear t;
+        if (!fastPath(t)) return Grid3D::getFieldValue(pos);
+        return (mode == LINEAR) ? sampleLayout<LINEAR>(t, pos[0], pos[1], pos[2]) : sampleLayout<SMOOTHSTEP>(t, pos[0], pos[1], pos[2]);
+    }
+
+    virtual void getFieldValues(const VEC3F* pos, Real* out, size_t n) const override {
+        Trilinear t;
+        if (!fastPath(t)) return Grid3D::getFieldValues(pos, out, n);
+        if (mode == LINEAR) sampleBatchLayout<LINEAR>(t, pos, out, n);
+        else sampleBatchLayout<SMOOTHSTEP>(t, pos, out, n);
+    }
+
+    virtual bool supportsConcurrentQueries() const override {
+        return baseGrid->supportsConcurrentQueries();
+    }
+
     virtual Real get(uint x, uint y, uint z) const override {
         return baseGrid->get(x, y, z);
     }
 
+    // Both modes blend the 8 cell corners with weights in [0, 1]
+    virtual bool getFieldBounds(const AABB& box, Real& lo, Real& hi) const override {
+        if (!hasMapBox) return false;
+        return latticeBounds(box, lo, hi);
+    }
+
     virtual Real getf(Real x, Real y, Real z) const override {
         // "Trilinear" interpolation with whatever technique we select
 
@@ -804,6 +2098,16 @@ public:
         return output;
     }
 
+    virtual void getRowSpan(uint x0, uint n, uint y, uint z, Real* out) const override {
+        baseGrid->getRowSpan(x0, n, y, z, out);
+    }
+
+    virtual void getfValues(const VEC3F* indices, Real* out, size_t n) const override {
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = InterpolationGrid::getf(indices[i][0], indices[i][1], indices[i][2]);
+        }
+    }
+
 
 
 };
@@ -934,7 +2238,7 @@ public:
         this->xRes = xRes;
         this->yRes = yRes;
         this->zRes = zRes;
-        values = new VEC3F[xRes * yRes * zRes];
+        values = new VEC3F[(size_t) xRes * yRes * zRes];
     }
 
     // Create empty (not zeroed) field with given resolution
@@ -944,17 +2248,22 @@ public:
 
     // Destructor
     ~ArrayVectorGrid3D() {
-        delete values;
+        delete[] values;
+    }
+
+    // The values in z-major order, as at() indexes them
+    const VEC3F* data() const {
+        return values;
     }
 
     // Access value based on integer indices
     VEC3F get(uint x, uint y, uint z) const override {
-        return values[(z * yRes + y) * xRes + x];
+        return values[((size_t) z * yRes + y) * xRes + x];
     }
 
     // Access value directly (allows setting)
     VEC3F& at(uint x, uint y, uint z) {
-        return values[(z * yRes + y) * xRes + x];
+        return values[((size_t) z * yRes + y) * xRes + x];
     }
 
     VEC3F& atFieldPos(VEC3F pos) {
@@ -986,25 +2295,31 @@ public:
     }
 
 
-    // Create field from scalar function by sampling it on a regular grid
+    // Create field from vector function by sampling it on a regular grid, a z slice per
+    // task, so the function has to be safe to query from several threads
     ArrayVectorGrid3D(uint xRes, uint yRes, uint zRes, VEC3F functionMin, VEC3F functionMax, VectorField3D *fieldFunction):ArrayVectorGrid3D(xRes, yRes, zRes){
 
-        VEC3F gridResF(xRes, yRes, zRes);
+        const VEC3F gridResF(xRes, yRes, zRes);
+        const VEC3F fieldDelta = functionMax - functionMin;
+        uint done = 0;
 
         PB_START("Sampling %dx%dx%d vector field into ArrayVectorGrid3D...", xRes, yRes, zRes);
 
-        for (uint i = 0; i < xRes; i++) {
+        #pragma omp parallel for schedule(dynamic)
+        for (uint k = 0; k < zRes; k++) {
+            vector<VEC3F> row(xRes);
             for (uint j = 0; j < yRes; j++) {
-                for (uint k = 0; k < zRes; k++) {
+                for (uint i = 0; i < xRes; i++) {
                     VEC3F gridPointF(i, j, k);
-                    VEC3F fieldDelta = functionMax - functionMin;
-
-                    VEC3F samplePoint = functionMin + (gridPointF.cwiseQuotient(gridResF - VEC3F(1,1,1)).cwiseProduct(fieldDelta));
-
-                    this->at(i, j, k) = fieldFunction->getFieldValue(samplePoint);
+                    row[i] = functionMin + (gridPointF.cwiseQuotient(gridResF - VEC3F(1,1,1)).cwiseProduct(fieldDelta));
                 }
+                fieldFunction->getFieldValues(row.data(), &this->at(0, j, k), xRes);
+            }
+
+            #pragma omp critical
+            {
+                PB_PROGRESS( ((Real) ++done)/zRes );
             }
-            PB_PROGRESS( ((Real) i)/xRes );
         }
         PB_END();
 
@@ -1015,6 +2330,120 @@ public:
 
 };
 
+// Trilinear interpolation over a VectorGrid3D, the vector counterpart of a LINEAR
+// InterpolationGrid. Over an ArrayVectorGrid3D the corners are read straight from its array.
+class VectorInterpolationGrid: public VectorGrid3D {
+private:
+    // Field position to grid index is (pos - origin) * scale, clamped to [0, last]
+    struct Trilinear {
+        const VEC3F* values;
+        VEC3F origin, scale, last;
+        size_t rowStride, sliceStride;
+    };
+
+    const ArrayVectorGrid3D* arrayBase = NULL;
+    Trilinear trilinear;
+    AABB trilinearBox;
+
+    static inline VEC3F lerp(const VEC3F& x0, const VEC3F& x1, Real d) {
+        return ((1 - d) * x0) + (d * x1);
+    }
+
+    static inline VEC3F sample(const Trilinear& t, const VEC3F& pos) {
+        const VEC3F p = (pos - t.origin).cwiseProduct(t.scale).cwiseMax(VEC3F(0, 0, 0)).cwiseMin(t.last);
+
+        const int x0 = p[0], y0 = p[1], z0 = p[2];
+        const Real xd = p[0] - x0, yd = p[1] - y0, zd = p[2] - z0;
+
+        // On the far faces the upper corner is clamped to the lower one
+        const size_t dx = (x0 < t.last[0]) ? 1 : 0;
+        const size_t dy = (y0 < t.last[1]) ? t.rowStride : 0;
+        const size_t dz = (z0 < t.last[2]) ? t.sliceStride : 0;
+        const VEC3F* c = t.values + (z0 * t.sliceStride + y0 * t.rowStride + x0);
+
+        const VEC3F c00 = lerp(c[0],       c[dx],           xd);
+        const VEC3F c01 = lerp(c[dz],      c[dz + dx],      xd);
+        const VEC3F c10 = lerp(c[dy],      c[dy + dx],      xd);
+        const VEC3F c11 = lerp(c[dz + dy], c[dz + dy + dx], xd);
+
+        const VEC3F c0 = lerp(c00, c10, yd);
+        const VEC3F c1 = lerp(c01, c11, yd);
+
+        return lerp(c0, c1, zd);
+    }
+
+    // As InterpolationGrid::fastPath: mapBox may have been assigned directly
+    bool fastPath() const {
+        return arrayBase && hasMapBox && mapBox.min() == trilinearBox.min() && mapBox.max() == trilinearBox.max();
+    }
+
+public:
+    VectorGrid3D* baseGrid;
+
+    VectorInterpolationGrid(VectorGrid3D* baseGrid) {
+        this->baseGrid = baseGrid;
+        xRes = baseGrid->xRes;
+        yRes = baseGrid->yRes;
+        zRes = baseGrid->zRes;
+        this->supportsNonIntegerIndices = true;
+        arrayBase = dynamic_cast<const ArrayVectorGrid3D*>(baseGrid);
+
+        if (baseGrid->hasMapBox) this->setMapBox(baseGrid->mapBox);
+    }
+
+    virtual void setMapBox(AABB box) override {
+        VectorGrid3D::setMapBox(box);
+
+        trilinearBox = box;
+        trilinear.values = arrayBase ? arrayBase->data() : NULL;
+        trilinear.origin = box.min();
+        trilinear.last = VEC3F(xRes - 1, yRes - 1, zRes - 1);
+        trilinear.scale = trilinear.last.cwiseQuotient(box.span());
+        trilinear.rowStride = xRes;
+        trilinear.sliceStride = (size_t) xRes * yRes;
+    }
+
+    virtual VEC3F getFieldValue(const VEC3F& pos) const override {
+        if (!fastPath()) return VectorGrid3D::getFieldValue(pos);
+        return sample(trilinear, pos);
+    }
+
+    virtual void getFieldValues(const VEC3F* pos, VEC3F* out, size_t n) const override {
+        if (!fastPath()) return VectorGrid3D::getFieldValues(pos, out, n);
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = sample(trilinear, pos[i]);
+        }
+    }
+
+    virtual VEC3F get(uint x, uint y, uint z) const override {
+        return baseGrid->get(x, y, z);
+    }
+
+    virtual VEC3F getf(Real x, Real y, Real z) const override {
+        const uint x0 = min((uint) max(0.0, floor(x)), xRes - 1);
+        const uint y0 = min((uint) max(0.0, floor(y)), yRes - 1);
+        const uint z0 = min((uint) max(0.0, floor(z)), zRes - 1);
+
+        const uint x1 = min(x0 + 1, xRes - 1);
+        const uint y1 = min(y0 + 1, yRes - 1);
+        const uint z1 = min(z0 + 1, zRes - 1);
+
+        const Real xd = min(1.0, max(0.0, x - x0));
+        const Real yd = min(1.0, max(0.0, y - y0));
+        const Real zd = min(1.0, max(0.0, z - z0));
+
+        const VEC3F c00 = lerp(baseGrid->get(x0, y0, z0), baseGrid->get(x1, y0, z0), xd);
+        const VEC3F c01 = lerp(baseGrid->get(x0, y0, z1), baseGrid->get(x1, y0, z1), xd);
+        const VEC3F c10 = lerp(baseGrid->get(x0, y1, z0), baseGrid->get(x1, y1, z0), xd);
+        const VEC3F c11 = lerp(baseGrid->get(x0, y1, z1), baseGrid->get(x1, y1, z1), xd);
+
+        const VEC3F c0 = lerp(c00, c10, yd);
+        const VEC3F c1 = lerp(c01, c11, yd);
+
+        return lerp(c0, c1, zd);
+    }
+};
+
 
 
 
@@ -1,6 +1,10 @@
 #ifndef JULIA_H
 #define JULIA_H
 
+#include <atomic>
+#include <random>
+#include <omp.h>
+
 #include "SETTINGS.h"
 #include "mesh.h"
 #include "field.h"
@@ -193,12 +197,21 @@ public:
 
 class R3Map {
 public:
+    virtual ~R3Map() {}
+
     virtual VEC3F getFieldValue(const VEC3F& q) const = 0;
 
     virtual VEC3F operator()(const VEC3F& q) const {
         return getFieldValue(q);
     }
 
+    // Maps n points in one call; see FieldFunction3D::getFieldValues
+    virtual void getFieldValues(const VEC3F* q, VEC3F* out, size_t n) const {
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = getFieldValue(q[i]);
+        }
+    }
+
     virtual void writeCSVPairs(string filename, uint xRes, uint yRes, uint zRes, VEC3F fieldMin, VEC3F fieldMax) {
         ofstream out;
         out.open(filename);
@@ -243,9 +256,27 @@ public:
     int maxIterations;
     Real escape;
 
+    enum ENGINE {
+        SCALAR,   // one point at a time
+        BATCH     // the whole batch iterates together, escaped points are dropped
+    };
+
+    // Engine used by getFieldValues. The batch engine only shares the map calls, which are
+    // the whole cost; BENCH shows it within noise of one point at a time on the portal and
+    // versor maps, so the scalar path, which matches getFieldValue exactly, is the default.
+    ENGINE engine;
+
+    static const char* engineName(ENGINE e) {
+        switch (e) {
+        case SCALAR:  return "scalar";
+        case BATCH:   return "batch";
+        }
+        return "unknown";
+    }
+
 public:
     R3JuliaSet(R3Map* m, int maxIterations = 3, Real escape = 20):
-        m(m), maxIterations(maxIterations), escape(escape) {}
+        m(m), maxIterations(maxIterations), escape(escape), engine(SCALAR) {}
 
     Real getFieldValue(const VEC3F& pos) const override {
         VEC3F iterate(pos);
@@ -263,6 +294,73 @@ public:
         return out;
     }
 
+    // Same as getFieldValue, also reporting how many times the map was applied
+    Real getFieldValueAndIterations(const VEC3F& pos, int& iterations) const {
+        VEC3F iterate(pos);
+        Real magnitude = iterate.norm();
+        iterations = 0;
+
+        while (magnitude < escape && iterations < maxIterations) {
+            iterate = m->getFieldValue(iterate);
+            magnitude = iterate.norm();
+            iterations++;
+        }
+
+        return log(magnitude);
+    }
+
+    void getFieldValues(const VEC3F* pos, Real* out, size_t n) const override {
+        switch (engine) {
+        case SCALAR:
+            for (size_t i = 0; i < n; ++i) {
+                out[i] = R3JuliaSet::getFieldValue(pos[i]);
+            }
+            break;
+        case BATCH:
+            iterateBatch(pos, out, n);
+            break;
+        }
+    }
+
+private:
+    // Iterates all n points together: each iteration maps the points that are
+    // still bounded in one batch, then drops the ones that escaped.
+    void iterateBatch(const VEC3F* pos, Real* out, size_t n) const {
+        vector<VEC3F>  iterates(pos, pos + n);
+        vector<Real>   magnitudes(n);
+        vector<size_t> active;
+        active.reserve(n);
+
+        for (size_t i = 0; i < n; ++i) {
+            magnitudes[i] = iterates[i].norm();
+            if (magnitudes[i] < escape) active.push_back(i);
+        }
+
+        vector<VEC3F> batchIn(active.size()), batchOut(active.size());
+
+        for (int totalIterations = 0; totalIterations < maxIterations && !active.empty(); totalIterations++) {
+            const size_t numActive = active.size();
+            for (size_t k = 0; k < numActive; ++k) {
+                batchIn[k] = iterates[active[k]];
+            }
+
+            m->getFieldValues(batchIn.data(), batchOut.data(), numActive);
+
+            size_t stillActive = 0;
+            for (size_t k = 0; k < numActive; ++k) {
+                const size_t i = active[k];
+                iterates[i] = batchOut[k];
+                magnitudes[i] = iterates[i].norm();
+                if (magnitudes[i] < escape) active[stillActive++] = i;
+            }
+            active.resize(stillActive);
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = log(magnitudes[i]);
+        }
+    }
+
 };
 
 class VersorModulusR3Map: public R3Map {
@@ -275,6 +373,16 @@ public:
     VEC3F getFieldValue(const VEC3F& pos) const override {
         return (*versor)(pos) * (*modulus)(pos);
     }
+
+    void getFieldValues(const VEC3F* pos, VEC3F* out, size_t n) const override {
+        vector<Real> radii(n);
+        versor->getFieldValues(pos, out, n);
+        modulus->getFieldValues(pos, radii.data(), n);
+
+        for (size_t i = 0; i < n; ++i) {
+            out[i] *= radii[i];
+        }
+    }
 };
 
 
@@ -309,8 +417,33 @@ public:
         return radius;
     }
 
+    void getFieldValues(const VEC3F* pos, Real* out, size_t n) const override {
+        vector<Real> distances(n);
+        distanceField->getFieldValues(pos, distances.data(), n);
+
+        vector<Real> aValues, bValues;
+        if (!hasConstantA) {
+            aValues.resize(n);
+            a->getFieldValues(pos, aValues.data(), n);
+        }
+        if (!hasConstantB) {
+            bValues.resize(n);
+            b->getFieldValues(pos, bValues.data(), n);
+        }
+
+        for (size_t i = 0; i < n; ++i) {
+            Real aValue = (hasConstantA ? constantA : aValues[i]);
+            Real bValue = (hasConstantB ? constantB : bValues[i]);
+            out[i] = exp( aValue * (distances[i] - bValue ));
+        }
+    }
+
 };
 
+/*
+   A unit vector field from three independently seeded siv::PerlinNoise channels, one per
+   axis, normalized.
+*/
 class NoiseVersor: public R3Map {
 public:
     // siv::PerlinNoise nx{ 1234567u };
@@ -338,60 +471,789 @@ public:
         // nz.reseed(14u); // Better
     }
 
+    // Each channel was octave3D_01 * 2 - 1, which -Ofast folds into octave3D_11 in some
+    // contexts and not others; asking for that directly keeps the values existing results
+    // were made with, wherever this is inlined.
     virtual VEC3F getFieldValue(const VEC3F& pos) const override {
-        VEC3F p = pos * scale;
+        VEC3F v;
+        getNoiseValues(&pos, &v, 1);
+        return v.normalized();
+    }
 
-        VEC3F v(
-            nx.octave3D_01(p.x(), p.y(), p.z(), octaves) * 2 - 1,
-            ny.octave3D_01(p.x(), p.y(), p.z(), octaves) * 2 - 1,
-            nz.octave3D_01(p.x(), p.y(), p.z(), octaves) * 2 - 1
-            );
+    virtual void getFieldValues(const VEC3F* pos, VEC3F* out, size_t n) const override {
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = NoiseVersor::getFieldValue(pos[i]);
+        }
+    }
 
-        return v.normalized();
+    // The three channels before normalization. Unlike the versor they stay smooth where
+    // all three pass through zero, so they are what BakedVersor samples.
+    void getNoiseValues(const VEC3F* pos, VEC3F* out, size_t n) const {
+        for (size_t i = 0; i < n; ++i) {
+            VEC3F p = pos[i] * scale;
+
+            out[i] = VEC3F(
+                nx.octave3D_11(p.x(), p.y(), p.z(), octaves),
+                ny.octave3D_11(p.x(), p.y(), p.z(), octaves),
+                nz.octave3D_11(p.x(), p.y(), p.z(), octaves)
+                );
+        }
     }
 };
 
+/*
+   NoiseVersor pre-sampled on a lattice over a box and served by trilinear interpolation,
+   normalized after the lookup. Points outside the box get the analytic versor. The raw
+   channels are baked rather than the versor, since interpolating unit vectors across the
+   channels' common zeros would blur the direction flips there.
+*/
+class BakedVersor: public R3Map {
+private:
+    // The raw channels as a VectorField3D, to sample into the grid
+    class NoiseField: public VectorField3D {
+    public:
+        const NoiseVersor* versor;
+        NoiseField(const NoiseVersor* versor): versor(versor) {}
+
+        virtual VEC3F getFieldValue(const VEC3F& pos) const override {
+            VEC3F out;
+            versor->getNoiseValues(&pos, &out, 1);
+            return out;
+        }
+
+        virtual void getFieldValues(const VEC3F* pos, VEC3F* out, size_t n) const override {
+            versor->getNoiseValues(pos, out, n);
+        }
+    };
+
+public:
+    const NoiseVersor* versor;
+    AABB box;
+    ArrayVectorGrid3D* grid;
+    VectorInterpolationGrid* interpolated;
+    double bakeSeconds;
+
+    // Samples the channels every `spacing` field units; see resolution for the lattice size
+    BakedVersor(const NoiseVersor* versor, const AABB& box, Real spacing): versor(versor), box(box) {
+        const VEC3I res = resolution(box, spacing);
+
+        NoiseField noise(versor);
+        const double start = omp_get_wtime();
+        grid = new ArrayVectorGrid3D(res[0], res[1], res[2], box.min(), box.max(), &noise);
+        bakeSeconds = omp_get_wtime() - start;
+        interpolated = new VectorInterpolationGrid(grid);
+    }
+
+    ~BakedVersor() {
+        delete interpolated;
+        delete grid;
+    }
+
+    size_t memoryBytes() const {
+        return (size_t) grid->totalCells() * sizeof(VEC3F);
+    }
+
+    // Samples per axis for a lattice `spacing` apart over box
+    static VEC3I resolution(const AABB& box, Real spacing) {
+        VEC3I res;
+        for (int a = 0; a < 3; a++) {
+            res[a] = max<Real>(2, ceil(box.span()[a] / spacing) + 1);
+        }
+        return res;
+    }
+
+    // Memory a bake at `spacing` over box would take
+    static size_t plannedBytes(const AABB& box, Real spacing) {
+        const VEC3I res = resolution(box, spacing);
+        return (size_t) res[0] * res[1] * res[2] * sizeof(VEC3F);
+    }
+
+    /*
+       Lattice spacing for which trilinear interpolation of the channels stays within maxError.
+       The error is bounded by (hx^2 + hy^2 + hz^2) / 8 times the largest second derivative M,
+       so h = sqrt(8 maxError / 3M). The spacing also keeps at least two samples per lattice
+       cell of the finest octave.
+    */
+    static Real pickSpacing(const NoiseVersor& versor, const AABB& box, Real maxError, int numPoints = 4096) {
+        const Real frequency = versor.scale * pow(2.0, max(1u, versor.octaves) - 1);
+        return min(sqrt(8 * maxError / (3 * maxCurvature(versor, box, numPoints))), 0.5 / frequency);
+    }
+
+    // The interpolation error bound of pickSpacing for a given spacing
+    static Real errorBound(const NoiseVersor& versor, const AABB& box, Real spacing, int numPoints = 4096) {
+        return 3 * spacing * spacing * maxCurvature(versor, box, numPoints) / 8;
+    }
+
+    // Largest second derivative of the channels, M above. It grows with the square of the noise
+    // frequency and is measured by central differences at random points in the box.
+    static Real maxCurvature(const NoiseVersor& versor, const AABB& box, int numPoints = 4096) {
+        const Real frequency = versor.scale * pow(2.0, max(1u, versor.octaves) - 1);
+        const Real h = 1e-3 / frequency;
+
+        mt19937 rng(1234);
+        uniform_real_distribution<Real> unit(0, 1);
+        Real curvature = 0;
+        for (int i = 0; i < numPoints; i++) {
+            const VEC3F p = box.min() + VEC3F(unit(rng), unit(rng), unit(rng)).cwiseProduct(box.span());
+            for (int a = 0; a < 3; a++) {
+                VEC3F q[3] = { p, p, p };
+                q[0][a] -= h;
+                q[2][a] += h;
+                VEC3F f[3];
+                versor.getNoiseValues(q, f, 3);
+                curvature = max(curvature, ((f[0] - 2 * f[1] + f[2]) / (h * h)).cwiseAbs().maxCoeff());
+            }
+        }
+        return curvature;
+    }
+
+    virtual VEC3F getFieldValue(const VEC3F& pos) const override {
+        if (!box.contains(pos)) return versor->getFieldValue(pos);
+        return interpolated->getFieldValue(pos).normalized();
+    }
+
+    // Points in the box take one batched lookup, the rest one batched analytic call
+    virtual void getFieldValues(const VEC3F* pos, VEC3F* out, size_t n) const override {
+        vector<size_t> outside;
+        for (size_t i = 0; i < n; ++i) {
+            if (box.contains(pos[i])) {
+                out[i] = interpolated->getFieldValue(pos[i]).normalized();
+            } else {
+                outside.push_back(i);
+            }
+        }
+
+        if (!outside.empty()) {
+            vector<VEC3F> mapIn(outside.size()), mapOut(outside.size());
+            for (size_t k = 0; k < outside.size(); ++k) {
+                mapIn[k] = pos[outside[k]];
+            }
+            versor->getFieldValues(mapIn.data(), mapOut.data(), mapIn.size());
+            for (size_t k = 0; k < outside.size(); ++k) {
+                out[outside[k]] = mapOut[k];
+            }
+        }
+    }
+
+    // Largest channel error, and largest and RMS versor errors, against the analytic noise at
+    // random points in the box. The largest versor errors are where the direction flips.
+    void measureError(int numPoints, Real& maxNoiseError, Real& maxVersorError, Real& rmsVersorError) const {
+        mt19937 rng(4321);
+        uniform_real_distribution<Real> unit(0, 1);
+        maxNoiseError = maxVersorError = rmsVersorError = 0;
+        for (int i = 0; i < numPoints; i++) {
+            const VEC3F p = box.min() + VEC3F(unit(rng), unit(rng), unit(rng)).cwiseProduct(box.span());
+            VEC3F exact;
+            versor->getNoiseValues(&p, &exact, 1);
+            const VEC3F baked = interpolated->getFieldValue(p);
+            maxNoiseError = max(maxNoiseError, (baked - exact).cwiseAbs().maxCoeff());
+            const Real versorError = (baked.normalized() - exact.normalized()).norm();
+            maxVersorError = max(maxVersorError, versorError);
+            rmsVersorError += versorError * versorError;
+        }
+        rmsVersorError = sqrt(rmsVersorError / numPoints);
+    }
+};
+
+/*
+   Sends points inside a portal sphere through that portal: scaled about its center, rotated,
+   and moved to its output center. Where spheres overlap the nearest center wins, then the
+   lowest index. Portals are found through a uniform grid over their spheres: each cell lists,
+   in portal order, the portals whose sphere's bounding box overlaps it, so a lookup only
+   measures the portals in pos's cell, and points outside the grid go straight to map. With
+   uniform radii this picks the same portal as a scan of all portals for the nearest one.
+*/
 class PortalMap: public R3Map {
 public:
+    struct Portal {
+        VEC3F center;
+        Real radius;
+        Real scale;                          // output size over input size
+        AngleAxis<Real> rotation;
+        VEC3F outputCenter = VEC3F(0, 0, 0);
+    };
+
     R3Map *map;
+    FieldFunction3D *mask;
 
-    vector<VEC3F>           portalCenters;
-    vector<AngleAxis<Real>> portalRotations;
+    // Portal parameters, one array per field so the cell searches and transforms run over
+    // contiguous values
+    vector<Real> centerX, centerY, centerZ;
+    vector<Real> radius, scale;
+    vector<Real> outputX, outputY, outputZ;
+    vector<Matrix<Real, 3, 3>> rotation;
+
+    PortalMap(R3Map *map, const vector<Portal>& portals, FieldFunction3D *mask = 0): map(map), mask(mask) {
+        for (const Portal& p : portals) {
+            centerX.push_back(p.center.x());
+            centerY.push_back(p.center.y());
+            centerZ.push_back(p.center.z());
+            radius.push_back(p.radius);
+            scale.push_back(p.scale);
+            outputX.push_back(p.outputCenter.x());
+            outputY.push_back(p.outputCenter.y());
+            outputZ.push_back(p.outputCenter.z());
+            rotation.push_back(p.rotation.toRotationMatrix());
+        }
+        buildIndex();
+    }
 
-    Real  portalRadius;
-    Real  portalScale;
-    FieldFunction3D *mask;
+    // All portals the same size and scale, with their outputs at the origin
+    PortalMap(R3Map *map, vector<VEC3F> portalCenters, vector<AngleAxis<Real>> portalRotations, Real portalRadius, Real portalScale, FieldFunction3D *mask = 0):
+        PortalMap(map, uniformPortals(portalCenters, portalRotations, portalRadius, portalScale), mask) {}
+
+    size_t numPortals() const {
+        return radius.size();
+    }
+
+    VEC3F center(int p) const {
+        return VEC3F(centerX[p], centerY[p], centerZ[p]);
+    }
+
+    // Index of the portal whose sphere holds pos, nearest center first and then lowest
+    // index, or -1 if there is none. dist is the distance to its center.
+    int findPortal(const VEC3F& pos, Real& dist) const {
+        if (radius.empty() || !gridBox.contains(pos)) return -1;
+
+        const uint c = cellIndex(cellOf(pos));
+        int closest = -1;
+        Real closestDist = numeric_limits<Real>::infinity();
+        for (uint k = cellStart[c]; k < cellStart[c + 1]; ++k) {
+            const Real dx = pos.x() - cellX[k];
+            const Real dy = pos.y() - cellY[k];
+            const Real dz = pos.z() - cellZ[k];
+            const Real d = sqrt(dx * dx + dy * dy + dz * dz);
+            if (d < cellRadius[k] && d < closestDist) {
+                closest = cellPortals[k];
+                closestDist = d;
+            }
+        }
+
+        dist = closestDist;
+        return closest;
+    }
+
+    // Whether any portal sphere comes within the (closed) box
+    bool touchesPortal(const AABB& box) const {
+        return anyPortalNear(box, [](uint p) { (void) p; return true; });
+    }
+
+    // Whether every portal whose sphere comes within the box sends its points into B(0, R)
+    bool portalOutputsWithin(const AABB& box, Real R) const {
+        return !anyPortalNear(box, [&](uint p) {
+            return VEC3F(outputX[p], outputY[p], outputZ[p]).norm() + radius[p] * scale[p] > R;
+        });
+    }
+
+    // Where portal p sends pos, at distance dist from its center
+    VEC3F throughPortal(int p, const VEC3F& pos, Real dist) const {
+        VEC3F ang = (pos - center(p)).normalized();
+        VEC3F out = (dist * ang * scale[p]);
+        return rotation[p] * out + VEC3F(outputX[p], outputY[p], outputZ[p]);
+    }
+
+    /*
+       Bakes the mask's sign into a bit grid per portal: res^3 nodes over the box around its
+       sphere, each bit set where the mask is > 0. Only nodes that can be the nearest to a point
+       in the sphere are evaluated. From then on a point in the sphere reads its nearest node's
+       bit instead of evaluating the mask. Rows are evaluated as batches, slices in parallel.
+    */
+    void bakeMask(uint res) {
+        if (!mask || radius.empty()) return;
+        res = max(res, 2u);
+        maskRes = 0;
+        maskRowWords = (res + 63) / 64;
+        maskBits.assign(numPortals() * res * res * maskRowWords, 0);
+        maskLookups = vector<LookupCount>(omp_get_max_threads());
+
+        size_t evaluated = 0;
+        const double start = omp_get_wtime();
+
+        #pragma omp parallel for schedule(dynamic) reduction(+:evaluated)
+        for (size_t slice = 0; slice < numPortals() * res; slice++) {
+            const uint p = slice / res, z = slice % res;
+            const Real cell = 2 * radius[p] / (res - 1);
+            const VEC3F origin = center(p) - VEC3F(radius[p], radius[p], radius[p]);
+            const Real reach = radius[p] + cell * sqrt(3.0) / 2;
+
+            vector<VEC3F> nodes;
+            vector<uint> columns;
+            vector<Real> values;
+            for (uint y = 0; y < res; y++) {
+                nodes.clear();
+                columns.clear();
+                for (uint x = 0; x < res; x++) {
+                    const VEC3F node = origin + VEC3F(x, y, z) * cell;
+                    if ((node - center(p)).norm() <= reach) {
+                        nodes.push_back(node);
+                        columns.push_back(x);
+                    }
+                }
+
+                values.resize(nodes.size());
+                mask->getFieldValues(nodes.data(), values.data(), nodes.size());
+                evaluated += nodes.size();
+
+                uint64_t* row = &maskBits[((size_t) slice * res + y) * maskRowWords];
+                for (size_t k = 0; k < nodes.size(); k++) {
+                    if (values[k] > 0) row[columns[k] / 64] |= uint64_t(1) << (columns[k] % 64);
+                }
+            }
+        }
 
-    PortalMap(R3Map *map, vector<VEC3F> portalCenters, vector<AngleAxis<Real>> portalRotations, Real portalRadius, Real portalScale, FieldFunction3D *mask = 0): map(map), portalCenters(portalCenters), portalRotations(portalRotations), portalRadius(portalRadius), portalScale(portalScale), mask(mask) {}
+        maskRes = res;
+        PRINTF("Baked the portal mask at %u^3 per portal: %zu mask evaluations, %.1f KB, %.2fs\n",
+            res, evaluated, maskBits.size() * sizeof(uint64_t) / 1024.0, omp_get_wtime() - start);
+    }
+
+    // Fraction of random points in the portal spheres where the baked sign differs from the mask
+    Real bakedMaskMismatch(int numPoints) const {
+        if (!maskRes) return 0;
+
+        mt19937 rng(1234);
+        uniform_real_distribution<Real> unit(-1, 1);
+        uniform_int_distribution<int> pick(0, numPortals() - 1);
+        int mismatches = 0;
+        for (int i = 0; i < numPoints; i++) {
+            const int p = pick(rng);
+            VEC3F offset;
+            do {
+                offset = VEC3F(unit(rng), unit(rng), unit(rng));
+            } while (offset.norm() >= 1);
+
+            const VEC3F pos = center(p) + offset * radius[p];
+            mismatches += bakedMask(p, pos) != ((*mask)(pos) > 0);
+        }
+        return (Real) mismatches / numPoints;
+    }
+
+    // Mask queries answered from the baked grid so far
+    size_t bakedMaskLookups() const {
+        size_t total = 0;
+        for (const LookupCount& count : maskLookups) total += count.n;
+        return total;
+    }
 
     virtual VEC3F getFieldValue(const VEC3F& pos) const override {
+        Real dist;
+        const int portal = findPortal(pos, dist);
 
-        VEC3F closestPortal = portalCenters[0];
-        AngleAxis<Real> portalRot = portalRotations[0];
+        if (portal < 0 || (mask && !maskAllows(portal, pos))) {
+            return (*map)(pos);
+        }
 
-        int i = 0;
-        for (auto p : portalCenters) {
-            if ((pos - closestPortal).norm() > (pos - p).norm()) {
-                closestPortal = p;
-                portalRot = portalRotations[i];
+        return throughPortal(portal, pos, dist);
+    }
+
+    // Points that go through a portal are mapped as they are found; the rest are passed on
+    // to the underlying map in one batched call, or the whole batch if no point is in a portal.
+    virtual void getFieldValues(const VEC3F* pos, VEC3F* out, size_t n) const override {
+        if (radius.empty()) {
+            map->getFieldValues(pos, out, n);
+            return;
+        }
+
+        vector<size_t> passThrough, masked;
+        passThrough.reserve(n);
+        size_t lookups = 0;
+
+        for (size_t j = 0; j < n; ++j) {
+            Real dist;
+            int portal = findPortal(pos[j], dist);
+            if (portal >= 0 && mask && maskRes) {
+                lookups++;
+                if (!bakedMask(portal, pos[j])) portal = -1;
+            }
+
+            if (portal < 0) {
+                passThrough.push_back(j);
+                continue;
             }
-            i++;
+
+            // With an unbaked mask, the points it rejects are overwritten by the map below
+            out[j] = throughPortal(portal, pos[j], dist);
+            if (mask && !maskRes) masked.push_back(j);
         }
+        if (lookups) countLookups(lookups);
 
-        Real  dist = (pos - closestPortal).norm();
-        VEC3F ang  = (pos - closestPortal).normalized();
+        if (!masked.empty()) {
+            vector<VEC3F> maskIn(masked.size());
+            vector<Real>  maskOut(masked.size());
+            for (size_t k = 0; k < masked.size(); ++k) {
+                maskIn[k] = pos[masked[k]];
+            }
+            mask->getFieldValues(maskIn.data(), maskOut.data(), maskIn.size());
 
-        if (dist < portalRadius) {
-            if (mask && (*mask)(pos) <= 0) {
-                return (*map)(pos);
+            for (size_t k = 0; k < masked.size(); ++k) {
+                if (maskOut[k] <= 0) passThrough.push_back(masked[k]);
             }
-            VEC3F out = (dist * ang * portalScale);
-            out = portalRot * out;
-            return out;
-        } else {
-            return (*map)(pos);
         }
 
+        if (passThrough.size() == n) {
+            map->getFieldValues(pos, out, n);
+        } else if (!passThrough.empty()) {
+            // Inputs in the first half, outputs in the second
+            const size_t k = passThrough.size();
+            vector<VEC3F> mapIO(2 * k);
+            for (size_t i = 0; i < k; ++i) {
+                mapIO[i] = pos[passThrough[i]];
+            }
+            map->getFieldValues(mapIO.data(), mapIO.data() + k, k);
+            for (size_t i = 0; i < k; ++i) {
+                out[passThrough[i]] = mapIO[k + i];
+            }
+        }
+    }
+
+private:
+    // Baked mask, if any: portal p's node (x, y, z) is bit x of row (p * maskRes + z) * maskRes + y
+    uint maskRes = 0;
+    size_t maskRowWords = 0;
+    vector<uint64_t> maskBits;
+
+    // Baked lookups, counted per thread on separate cache lines so they don't contend; a
+    // thread number past the end (e.g. in a nested team) shares a slot, hence the atomics
+    struct alignas(64) LookupCount { atomic<size_t> n{0}; };
+    mutable vector<LookupCount> maskLookups;
+
+    void countLookups(size_t n) const {
+        maskLookups[omp_get_thread_num() % maskLookups.size()].n.fetch_add(n, memory_order_relaxed);
+    }
+
+    bool bakedMask(int p, const VEC3F& pos) const {
+        const Real cell = 2 * radius[p] / (maskRes - 1);
+        const VEC3F node = (pos - center(p) + VEC3F(radius[p], radius[p], radius[p])) / cell;
+        uint index[3];
+        for (int a = 0; a < 3; a++) {
+            index[a] = min<Real>(maskRes - 1, max<Real>(0, round(node[a])));
+        }
+        const uint64_t word = maskBits[(((size_t) p * maskRes + index[2]) * maskRes + index[1]) * maskRowWords + index[0] / 64];
+        return (word >> (index[0] % 64)) & 1;
+    }
+
+    bool maskAllows(int p, const VEC3F& pos) const {
+        if (!maskRes) return (*mask)(pos) > 0;
+        countLookups(1);
+        return bakedMask(p, pos);
+    }
+
+    AABB gridBox;
+    VEC3I gridRes;
+    Real cellSize;
+    vector<uint> cellStart;   // cell c's portals are cellPortals[cellStart[c] .. cellStart[c + 1])
+    vector<uint> cellPortals;
+    vector<Real> cellX, cellY, cellZ, cellRadius; // their centers and radii, in the same order
+
+    static vector<Portal> uniformPortals(const vector<VEC3F>& centers, const vector<AngleAxis<Real>>& rotations, Real radius, Real scale) {
+        vector<Portal> portals;
+        for (size_t i = 0; i < centers.size(); i++) {
+            Portal p;
+            p.center = centers[i];
+            p.radius = radius;
+            p.scale = scale;
+            p.rotation = rotations[i];
+            portals.push_back(p);
+        }
+        return portals;
+    }
+
+    VEC3I cellOf(const VEC3F& pos) const {
+        const VEC3F cell = (pos - gridBox.min()) / cellSize;
+        VEC3I index;
+        for (int a = 0; a < 3; a++) {
+            index[a] = min(gridRes[a] - 1, max(0, (int) floor(cell[a])));
+        }
+        return index;
+    }
+
+    uint cellIndex(const VEC3I& cell) const {
+        return ((uint) cell.z() * gridRes.y() + cell.y()) * gridRes.x() + cell.x();
+    }
+
+    // Whether pred holds for any portal whose sphere comes within the (closed) box
+    template<class PRED>
+    bool anyPortalNear(const AABB& box, PRED pred) const {
+        if (radius.empty() || !gridBox.intersects(box)) return false;
+
+        const VEC3I lo = cellOf(box.min().cwiseMax(gridBox.min()));
+        const VEC3I hi = cellOf(box.max().cwiseMin(gridBox.max()));
+        for (int z = lo.z(); z <= hi.z(); z++) {
+            for (int y = lo.y(); y <= hi.y(); y++) {
+                for (int x = lo.x(); x <= hi.x(); x++) {
+                    const uint c = cellIndex(VEC3I(x, y, z));
+                    for (uint k = cellStart[c]; k < cellStart[c + 1]; ++k) {
+                        const uint p = cellPortals[k];
+                        if (box.exteriorDistance(center(p)) <= radius[p] && pred(p)) return true;
+                    }
+                }
+            }
+        }
+        return false;
+    }
+
+    // Cells are one largest sphere across, and grow if needed to keep the grid within 64
+    // cells per portal
+    void buildIndex() {
+        if (radius.empty()) return;
+
+        auto sphereBox = [&](uint p) {
+            const VEC3F r(radius[p], radius[p], radius[p]);
+            return AABB(center(p) - r, center(p) + r);
+        };
+
+        gridBox = sphereBox(0);
+        for (uint p = 0; p < numPortals(); p++) {
+            gridBox.extend(sphereBox(p));
+        }
+
+        const double maxCells = max<double>(4096, 64.0 * numPortals());
+        cellSize = max(2 * *max_element(radius.begin(), radius.end()), gridBox.span().maxCoeff() / 1024);
+        if (cellSize <= 0) cellSize = 1;
+        while (true) {
+            const VEC3F cells = (gridBox.span() / cellSize).array().ceil().max(1);
+            if (cells.prod() <= maxCells) {
+                gridRes = cells.cast<int>();
+                break;
+            }
+            cellSize *= 1.25;
+        }
+
+        // The cells each portal's sphere box overlaps, in portal order
+        auto forEachCell = [&](auto visit) {
+            for (uint p = 0; p < numPortals(); p++) {
+                const AABB box = sphereBox(p);
+                const VEC3I lo = cellOf(box.min()), hi = cellOf(box.max());
+                for (int z = lo.z(); z <= hi.z(); z++)
+                    for (int y = lo.y(); y <= hi.y(); y++)
+                        for (int x = lo.x(); x <= hi.x(); x++)
+                            visit(cellIndex(VEC3I(x, y, z)), p);
+            }
+        };
+
+        // Counting sort into cells, which keeps portal order within each cell
+        const uint numCells = gridRes.prod();
+        cellStart.assign(numCells + 1, 0);
+        forEachCell([&](uint c, uint p) { (void) p; cellStart[c + 1]++; });
+        for (uint c = 0; c < numCells; c++) {
+            cellStart[c + 1] += cellStart[c];
+        }
+
+        const size_t entries = cellStart[numCells];
+        cellPortals.resize(entries);
+        cellX.resize(entries);
+        cellY.resize(entries);
+        cellZ.resize(entries);
+        cellRadius.resize(entries);
+
+        vector<uint> filled(cellStart.begin(), cellStart.end() - 1);
+        forEachCell([&](uint c, uint p) {
+            const uint k = filled[c]++;
+            cellPortals[k] = p;
+            cellX[k] = centerX[p];
+            cellY[k] = centerY[p];
+            cellZ[k] = centerZ[p];
+            cellRadius[k] = radius[p];
+        });
+    }
+};
+
+// Samples a shape modulus Julia set on a lattice like VirtualGrid3D, but first sorts
+// the lattice into blocks from the SDF alone. Blocks that provably can't hold the
+// surface are given a sign without iterating the Julia set:
+//
+//   OUTSIDE: every point escapes on the first iteration, since |versor| = 1 and
+//            exp(a*(d-b)) >= escape. The value is exactly a*(d-b), as the Julia set
+//            would return.
+//   INSIDE:  the first iterate lands in a ball B(0,R), R < 1, that the map sends back
+//            into itself (through the modulus and through any portal it overlaps), so
+//            the point never escapes. The value is a*(d-b) <= log(R) < 0, a stand-in
+//            with the right sign.
+//
+// Blocks touching a portal sphere are always iterated. Culling needs constant a > 0
+// and b, unit versors, and a distance field that can bound itself (getFieldBounds);
+// otherwise nothing is culled.
+class ShellCulledJuliaGrid: public VirtualGrid3D {
+private:
+    enum BLOCK_CLASS : unsigned char { MIXED, OUTSIDE, INSIDE };
+
+    ShapeModulus* modulus;
+    uint blockSize;
+    uint xBlocks, yBlocks, zBlocks;
+    vector<unsigned char> blockClass;
+
+    BLOCK_CLASS classOf(uint x, uint y, uint z) const {
+        x = min(x / blockSize, xBlocks - 1);
+        y = min(y / blockSize, yBlocks - 1);
+        z = min(z / blockSize, zBlocks - 1);
+        return (BLOCK_CLASS) blockClass[(z * yBlocks + y) * xBlocks + x];
+    }
+
+    // Log-magnitude of the first iterate (or of the point itself if it starts escaped)
+    Real culledValue(const VEC3F& p) const {
+        const Real magnitude = p.norm();
+        if (magnitude >= escape) return log(magnitude);
+        return modulus->constantA * (modulus->distanceField->getFieldValue(p) - modulus->constantB);
+    }
+
+    static bool touchesPortal(const AABB& box, const PortalMap* portals) {
+        return portals && portals->touchesPortal(box);
+    }
+
+public:
+    Real escape;
+    Real insideRadius = 0; // R of the invariant ball, 0 if inside culling is off
+
+    mutable atomic<size_t> numEvaluated{0};
+    mutable atomic<size_t> numCulled{0};
+
+    // The Julia set must iterate either portals (if given) or a VersorModulusR3Map
+    // built on modulus, with portals in turn wrapping that map.
+    ShellCulledJuliaGrid(uint xRes, uint yRes, uint zRes, VEC3F functionMin, VEC3F functionMax, R3JuliaSet* julia, ShapeModulus* modulus, PortalMap* portals, uint blockSize = 8):
+        VirtualGrid3D(xRes, yRes, zRes, functionMin, functionMax, julia),
+        modulus(modulus),
+        blockSize(max(blockSize, 1u)),
+        escape(julia->escape) {
+
+        xBlocks = (xRes + this->blockSize - 1) / this->blockSize;
+        yBlocks = (yRes + this->blockSize - 1) / this->blockSize;
+        zBlocks = (zRes + this->blockSize - 1) / this->blockSize;
+        blockClass.assign(xBlocks * yBlocks * zBlocks, MIXED);
+
+        const R3Map* iterated = portals ? portals->map : julia->m;
+        const VersorModulusR3Map* vm = dynamic_cast<const VersorModulusR3Map*>(iterated);
+        Real lo, hi;
+        const bool canCull =
+            (portals == 0 || julia->m == portals) &&
+            vm && vm->modulus == modulus &&
+            modulus->hasConstantA && modulus->hasConstantB && modulus->constantA > 0 &&
+            julia->maxIterations > 0 && escape > 1 &&
+            modulus->distanceField->getFieldBounds(AABB(VEC3F(0,0,0), VEC3F(0,0,0)), lo, hi);
+
+        if (!canCull) {
+            PRINT("Warning: shell culling needs a constant-parameter ShapeModulus over a bounded SDF; culling nothing.");
+            return;
+        }
+
+        const Real a = modulus->constantA;
+        const Real b = modulus->constantB;
+
+        // Largest R the map provably keeps inside B(0,R), checked conservatively over
+        // the cube around the ball
+        const Real candidates[] = { 0.9, 0.75, 0.5, 0.25, 0.1, 0.01 };
+        for (Real R : candidates) {
+            const AABB ball(VEC3F(-R,-R,-R), VEC3F(R,R,R));
+            if (portals && !portals->portalOutputsWithin(ball, R)) continue;
+            modulus->distanceField->getFieldBounds(ball, lo, hi);
+            if (a * (hi - b) <= log(R)) {
+                insideRadius = R;
+                break;
+            }
+        }
+
+        // Slightly inflated so rounding in exp() can't flip an escape
+        const Real outsideD = b + log(escape * 1.001) / a;
+        const Real insideD  = insideRadius > 0 ? b + log(insideRadius) / a : -numeric_limits<Real>::infinity();
+
+        size_t outside = 0, inside = 0;
+        #pragma omp parallel for schedule(dynamic, 1) reduction(+:outside, inside) collapse(2)
+        for (uint bz = 0; bz < zBlocks; ++bz) {
+            for (uint by = 0; by < yBlocks; ++by) {
+                for (uint bx = 0; bx < xBlocks; ++bx) {
+                    const AABB box(getSamplePoint(bx * this->blockSize, by * this->blockSize, bz * this->blockSize),
+                                   getSamplePoint(min((bx + 1) * this->blockSize, xRes),
+                                                  min((by + 1) * this->blockSize, yRes),
+                                                  min((bz + 1) * this->blockSize, zRes)));
+                    if (touchesPortal(box, portals)) continue;
+
+                    Real dLo, dHi;
+                    modulus->distanceField->getFieldBounds(box, dLo, dHi);
+
+                    unsigned char c = MIXED;
+                    if (dLo >= outsideD) {
+                        c = OUTSIDE;
+                        outside++;
+                    } else if (dHi <= insideD && box.exteriorDistance(VEC3F(0,0,0)) + box.diagonal().norm() < escape) {
+                        c = INSIDE;
+                        inside++;
+                    }
+                    blockClass[(bz * yBlocks + by) * xBlocks + bx] = c;
+                }
+            }
+        }
+
+        const Real total = blockClass.size();
+        PRINTF("Shell culling (%u^3 blocks, inside ball R=%g): %.1f%% outside, %.1f%% inside, %.1f%% of the volume culled\n",
+            this->blockSize, insideRadius, 100 * outside / total, 100 * inside / total, 100 * (outside + inside) / total);
+    }
+
+    virtual Real getf(Real x, Real y, Real z) const override {
+        const VEC3F p = getSamplePoint(x, y, z);
+        if (classOf(x, y, z) != MIXED) {
+            numCulled.fetch_add(1, memory_order_relaxed);
+            return culledValue(p);
+        }
+        numEvaluated.fetch_add(1, memory_order_relaxed);
+        return fieldFunction->getFieldValue(p);
+    }
+
+    virtual Real get(uint x, uint y, uint z) const override {
+        return getf(x, y, z);
+    }
+
+    virtual void getRowSpan(uint x0, uint n, uint y, uint z, Real* out) const override {
+        vector<VEC3F> indices(n);
+        for (uint i = 0; i < n; ++i) {
+            indices[i] = VEC3F(x0 + i, y, z);
+        }
+        getfValues(indices.data(), out, n);
+    }
+
+    virtual void getfValues(const VEC3F* indices, Real* out, size_t n) const override {
+        vector<VEC3F>  samplePoints;
+        vector<size_t> pending;
+        samplePoints.reserve(n);
+        pending.reserve(n);
+
+        for (size_t i = 0; i < n; ++i) {
+            const VEC3F p = getSamplePoint(indices[i][0], indices[i][1], indices[i][2]);
+            if (classOf(indices[i][0], indices[i][1], indices[i][2]) != MIXED) {
+                out[i] = culledValue(p);
+            } else {
+                samplePoints.push_back(p);
+                pending.push_back(i);
+            }
+        }
+
+        vector<Real> values(pending.size());
+        fieldFunction->getFieldValues(samplePoints.data(), values.data(), pending.size());
+        for (size_t k = 0; k < pending.size(); ++k) {
+            out[pending[k]] = values[k];
+        }
+
+        numCulled.fetch_add(n - pending.size(), memory_order_relaxed);
+        numEvaluated.fetch_add(pending.size(), memory_order_relaxed);
+    }
+
+    virtual bool getIndexSignBound(const VEC3I& lo, const VEC3I& hi, int& sign) const override {
+        bool outside = false, inside = false;
+        for (uint bz = lo.z() / blockSize; bz <= min((uint) hi.z() / blockSize, zBlocks - 1); ++bz) {
+            for (uint by = lo.y() / blockSize; by <= min((uint) hi.y() / blockSize, yBlocks - 1); ++by) {
+                for (uint bx = lo.x() / blockSize; bx <= min((uint) hi.x() / blockSize, xBlocks - 1); ++bx) {
+                    switch (blockClass[(bz * yBlocks + by) * xBlocks + bx]) {
+                    case MIXED:   sign = 0; return true;
+                    case OUTSIDE: outside = true; break;
+                    case INSIDE:  inside = true; break;
+                    }
+                }
+            }
+        }
+        sign = (outside == inside) ? 0 : (outside ? 1 : -1);
+        return true;
+    }
+
+    void printStats() const {
+        const size_t total = numCulled + numEvaluated;
+        PRINTF("Shell culling skipped %zu of %zu Julia evaluations (%.1f%%)\n", (size_t) numCulled, total, total ? 100.0 * numCulled / total : 0.0);
     }
 };
 
@@ -3,7 +3,15 @@
 #include <fstream>
 #include <iostream>
 #include <cstdio>
+#include <cstring>
+#include <strings.h>
 #include <string>
+#include <charconv>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "SETTINGS.h"
 #include "triangle.h"
@@ -11,6 +19,380 @@
 
 using namespace std;
 
+/*
+   Receives a mesh piece by piece, so the whole mesh never has to be in memory. Vertices
+   are numbered in the order they arrive, and triangles may only use vertices already added.
+*/
+class MeshSink {
+public:
+    virtual ~MeshSink() {}
+    virtual void addVertices(const VEC3F* positions, const VEC3F* normals, size_t n) = 0;
+    virtual void addTriangles(const uint* indices, size_t numTriangles) = 0;
+    virtual void close() = 0;
+
+    size_t numVertices = 0;
+    size_t numTriangles = 0;
+};
+
+/*
+   OBJ text output. Lines are formatted with std::to_chars in parallel, in chunks, and
+   written in order through a large buffer. Reals use 6 significant digits, like an
+   ostream at default precision.
+*/
+class OBJWriter : public MeshSink {
+public:
+    OBJWriter(const std::string& filename, bool hasNormals = true): filename(filename), hasNormals(hasNormals) {
+        file = fopen(filename.c_str(), "wb");
+        if (file == NULL) {
+            printf("Could not open OBJ file %s for writing.\n", filename.c_str());
+            exit(1);
+        }
+        setvbuf(file, NULL, _IOFBF, 1 << 22);
+        fputs("g Obj\n", file);
+    }
+
+    ~OBJWriter() { close(); }
+
+    void addVertices(const VEC3F* positions, const VEC3F* normals, size_t n) override {
+        writeLines(n, 64, [&](size_t i, char* p) { return writeVector(p, "v ", positions[i]); });
+        if (hasNormals)
+            writeLines(n, 64, [&](size_t i, char* p) { return writeVector(p, "vn ", normals[i]); });
+        numVertices += n;
+    }
+
+    void addTriangles(const uint* indices, size_t numTriangles) override {
+        writeLines(numTriangles, 80, [&](size_t t, char* p) {
+            *p++ = 'f';
+            for (int c = 0; c < 3; c++) {
+                *p++ = ' ';
+                p = std::to_chars(p, p + 10, indices[3 * t + c] + 1).ptr;
+                if (hasNormals) {
+                    *p++ = '/';
+                    *p++ = '/';
+                    p = std::to_chars(p, p + 10, indices[3 * t + c] + 1).ptr;
+                }
+            }
+            *p++ = '\n';
+            return p;
+        });
+        this->numTriangles += numTriangles;
+    }
+
+    void close() override {
+        if (!file) return;
+        fclose(file);
+        file = NULL;
+    }
+
+private:
+    std::string filename;
+    bool hasNormals;
+    FILE* file;
+
+    static char* writeVector(char* p, const char* tag, const VEC3F& v) {
+        while (*tag) *p++ = *tag++;
+        for (int c = 0; c < 3; c++) {
+            if (c) *p++ = ' ';
+            p = std::to_chars(p, p + 20, v[c], std::chars_format::general, 6).ptr;
+        }
+        *p++ = '\n';
+        return p;
+    }
+
+    // Formats n lines of at most maxLine chars each with line(i, out) -> end of the line
+    template <class LINE>
+    void writeLines(size_t n, size_t maxLine, LINE line) {
+        const size_t chunkLines = 1 << 14;
+        const size_t chunksPerRound = 64;
+        std::vector<std::vector<char>> chunks(chunksPerRound);
+        std::vector<size_t> used(chunksPerRound);
+
+        for (size_t first = 0; first < n; first += chunkLines * chunksPerRound) {
+            const size_t numChunks = std::min(chunksPerRound, (n - first + chunkLines - 1) / chunkLines);
+
+            #pragma omp parallel for schedule(dynamic) if(numChunks > 1)
+            for (size_t c = 0; c < numChunks; c++) {
+                const size_t begin = first + c * chunkLines;
+                const size_t end = std::min(n, begin + chunkLines);
+                chunks[c].resize((end - begin) * maxLine);
+                char* p = chunks[c].data();
+                for (size_t i = begin; i < end; i++)
+                    p = line(i, p);
+                used[c] = p - chunks[c].data();
+            }
+
+            for (size_t c = 0; c < numChunks; c++)
+                fwrite(chunks[c].data(), 1, used[c], file);
+        }
+    }
+};
+
+/*
+   Binary little-endian PLY output, float32 positions (and normals) and int32 triangle
+   indices. PLY wants every vertex before the first face, so faces are spooled to a
+   temporary file and appended by close(), which also fills in the element counts (written
+   zero-padded to a fixed width in the header).
+*/
+class PLYWriter : public MeshSink {
+public:
+    PLYWriter(const std::string& filename, bool hasNormals = true): filename(filename), hasNormals(hasNormals) {
+        file = fopen(filename.c_str(), "wb");
+        if (file == NULL) {
+            printf("Could not open PLY file %s for writing.\n", filename.c_str());
+            exit(1);
+        }
+        setvbuf(file, NULL, _IOFBF, 1 << 22);
+
+        fputs("ply\nformat binary_little_endian 1.0\n", file);
+        vertexCountOffset = ftell(file) + strlen("element vertex ");
+        writeCount("vertex", 0);
+        fputs("property float x\nproperty float y\nproperty float z\n", file);
+        if (hasNormals)
+            fputs("property float nx\nproperty float ny\nproperty float nz\n", file);
+        faceCountOffset = ftell(file) + strlen("element face ");
+        writeCount("face", 0);
+        fputs("property list uchar int vertex_indices\nend_header\n", file);
+
+        faceFile = tmpfile();
+        if (faceFile == NULL) {
+            printf("Could not create a temporary file for the faces of %s.\n", filename.c_str());
+            exit(1);
+        }
+    }
+
+    ~PLYWriter() { close(); }
+
+    void addVertices(const VEC3F* positions, const VEC3F* normals, size_t n) override {
+        const size_t stride = hasNormals ? 24 : 12;
+        buffer.resize(n * stride);
+        for (size_t i = 0; i < n; i++) {
+            char* p = &buffer[i * stride];
+            for (int c = 0; c < 3; c++) p = putFloat(p, positions[i][c]);
+            if (hasNormals)
+                for (int c = 0; c < 3; c++) p = putFloat(p, normals[i][c]);
+        }
+        fwrite(buffer.data(), 1, buffer.size(), file);
+        numVertices += n;
+    }
+
+    void addTriangles(const uint* indices, size_t numTriangles) override {
+        buffer.resize(numTriangles * 13);
+        for (size_t t = 0; t < numTriangles; t++) {
+            char* p = &buffer[t * 13];
+            *p++ = 3;
+            for (int c = 0; c < 3; c++) p = putUint(p, indices[3 * t + c]);
+        }
+        fwrite(buffer.data(), 1, buffer.size(), faceFile);
+        this->numTriangles += numTriangles;
+    }
+
+    void close() override {
+        if (!file) return;
+
+        buffer.resize(1 << 22);
+        rewind(faceFile);
+        size_t n;
+        while ((n = fread(buffer.data(), 1, buffer.size(), faceFile)) > 0)
+            fwrite(buffer.data(), 1, n, file);
+        fclose(faceFile);
+
+        fseek(file, vertexCountOffset - strlen("element vertex "), SEEK_SET);
+        writeCount("vertex", numVertices);
+        fseek(file, faceCountOffset - strlen("element face "), SEEK_SET);
+        writeCount("face", numTriangles);
+        fclose(file);
+        file = NULL;
+    }
+
+private:
+    std::string filename;
+    bool hasNormals;
+    FILE* file;
+    FILE* faceFile;
+    long vertexCountOffset, faceCountOffset;
+    std::vector<char> buffer;
+
+    void writeCount(const char* element, size_t count) {
+        fprintf(file, "element %s %012zu\n", element, count);
+    }
+
+    static char* putUint(char* p, uint32_t v) {
+        for (int b = 0; b < 4; b++) *p++ = char((v >> (8 * b)) & 0xff);
+        return p;
+    }
+
+    static char* putFloat(char* p, Real v) {
+        float f = float(v);
+        uint32_t bits;
+        memcpy(&bits, &f, 4);
+        return putUint(p, bits);
+    }
+};
+
+/*
+   OBJ text input. The file is memory-mapped and cut into chunks at line boundaries, which
+   are parsed in parallel with std::from_chars and joined in order. Only v and f lines are
+   used: vn, vt, groups, comments and the like are skipped, and so are the texture and normal
+   indices in f a/b/c, a//c and a/b. Negative (relative) indices are resolved, and polygons
+   are fanned into triangles. Positions are parsed straight into T, so float readers round
+   the way an istream into a float would.
+*/
+template <class T>
+class OBJReader {
+public:
+    std::vector<T> positions;     // x, y, z per vertex
+    std::vector<uint> indices;    // three zero-based vertex indices per triangle
+    size_t ignoredLines = 0;      // non-blank lines that aren't v or f
+
+    OBJReader(const std::string& filename): filename(filename) {
+        const int fd = open(filename.c_str(), O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            printf("Could not open OBJ file %s for reading.\n", filename.c_str());
+            exit(1);
+        }
+        const size_t size = st.st_size;
+        const char* data = NULL;
+        if (size > 0) {
+            void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped == MAP_FAILED) {
+                printf("Could not map OBJ file %s.\n", filename.c_str());
+                exit(1);
+            }
+            madvise(mapped, size, MADV_SEQUENTIAL);
+            data = (const char*) mapped;
+        }
+        close(fd);
+
+        // chunks start just after a newline, so every line belongs to exactly one
+        const size_t chunkBytes = 1 << 22;
+        const size_t numChunks = (size + chunkBytes - 1) / chunkBytes;
+        std::vector<size_t> starts(numChunks + 1, size);
+        for (size_t c = 0; c < numChunks; c++) {
+            const char* newline = c ? (const char*) memchr(data + c * chunkBytes - 1, '\n', size - c * chunkBytes + 1) : NULL;
+            starts[c] = c == 0 ? 0 : newline ? newline - data + 1 : size;
+        }
+
+        std::vector<Chunk> chunks(numChunks);
+        #pragma omp parallel for schedule(dynamic)
+        for (size_t c = 0; c < numChunks; c++)
+            parse(data + starts[c], data + starts[c + 1], chunks[c]);
+        if (size > 0) munmap((void*) data, size);
+
+        // join, shifting relative indices by the vertices in the chunks before
+        std::vector<size_t> vertexStart(numChunks + 1, 0), indexStart(numChunks + 1, 0);
+        for (size_t c = 0; c < numChunks; c++) {
+            vertexStart[c + 1] = vertexStart[c] + chunks[c].positions.size();
+            indexStart[c + 1] = indexStart[c] + chunks[c].indices.size();
+            ignoredLines += chunks[c].ignoredLines;
+            if (!chunks[c].badLine.empty()) {
+                printf("Encountered malformed data when reading OBJ %s: \"%s\"\n", filename.c_str(), chunks[c].badLine.c_str());
+                exit(1);
+            }
+        }
+        positions.resize(vertexStart[numChunks]);
+        indices.resize(indexStart[numChunks]);
+        const int64_t numVertices = positions.size() / 3;
+        bool outOfRange = false;
+
+        #pragma omp parallel for schedule(dynamic) reduction(||:outOfRange)
+        for (size_t c = 0; c < numChunks; c++) {
+            const Chunk& chunk = chunks[c];
+            std::copy(chunk.positions.begin(), chunk.positions.end(), positions.begin() + vertexStart[c]);
+            const int64_t shift = vertexStart[c] / 3;
+            size_t r = 0;
+            for (size_t i = 0; i < chunk.indices.size(); i++) {
+                int64_t index = chunk.indices[i];
+                if (r < chunk.relative.size() && chunk.relative[r] == i) {
+                    index += shift;
+                    r++;
+                }
+                outOfRange = outOfRange || index < 0 || index >= numVertices;
+                indices[indexStart[c] + i] = index;
+            }
+        }
+        if (outOfRange) {
+            printf("OBJ %s has faces that use vertices it doesn't have.\n", filename.c_str());
+            exit(1);
+        }
+    }
+
+    size_t numVertices() const { return positions.size() / 3; }
+    size_t numTriangles() const { return indices.size() / 3; }
+
+private:
+    struct Chunk {
+        std::vector<T> positions;
+        std::vector<int64_t> indices;   // zero-based, or counted from the chunk's first vertex for relative ones
+        std::vector<size_t> relative;   // which indices are chunk-local, in order
+        size_t ignoredLines = 0;
+        std::string badLine;            // the first line that didn't parse, if any
+    };
+
+    std::string filename;
+
+    static const char* skipSpaces(const char* p, const char* end) {
+        while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+        return p;
+    }
+
+    static void parse(const char* p, const char* end, Chunk& chunk) {
+        std::vector<int64_t> corners;
+        std::vector<bool> relative;
+        while (p < end) {
+            const char* lineEnd = (const char*) memchr(p, '\n', end - p);
+            if (lineEnd == NULL) lineEnd = end;
+            const char* q = skipSpaces(p, lineEnd);
+            const bool v = lineEnd - q > 1 && q[0] == 'v' && (q[1] == ' ' || q[1] == '\t');
+            const bool f = lineEnd - q > 1 && q[0] == 'f' && (q[1] == ' ' || q[1] == '\t');
+
+            bool ok = true;
+            if (v) {
+                q++;
+                for (int c = 0; c < 3 && ok; c++) {
+                    q = skipSpaces(q, lineEnd);
+                    if (q < lineEnd && *q == '+') q++;
+                    T x;
+                    const std::from_chars_result r = std::from_chars(q, lineEnd, x);
+                    ok = r.ec == std::errc();
+                    q = r.ptr;
+                    chunk.positions.push_back(x);
+                }
+            } else if (f) {
+                q++;
+                corners.clear();
+                relative.clear();
+                while (ok && (q = skipSpaces(q, lineEnd)) < lineEnd) {
+                    if (*q == '+') q++;
+                    int64_t index;
+                    const std::from_chars_result r = std::from_chars(q, lineEnd, index);
+                    ok = r.ec == std::errc() && index != 0;
+                    q = r.ptr;
+                    // vertex index then optional /texture/normal
+                    while (q < lineEnd && (*q == '/' || *q == '-' || (*q >= '0' && *q <= '9'))) q++;
+                    // -1 is the latest vertex, which is only known relative to this chunk
+                    corners.push_back(index < 0 ? (int64_t) chunk.positions.size() / 3 + index : index - 1);
+                    relative.push_back(index < 0);
+                }
+                ok = ok && corners.size() >= 3;
+                for (size_t c = 1; ok && c + 1 < corners.size(); c++) {
+                    for (size_t corner : { (size_t) 0, c, c + 1 }) {
+                        if (relative[corner]) chunk.relative.push_back(chunk.indices.size());
+                        chunk.indices.push_back(corners[corner]);
+                    }
+                }
+            } else if (q < lineEnd) {
+                chunk.ignoredLines++;
+            }
+
+            if (!ok && chunk.badLine.empty()) {
+                chunk.badLine.assign(skipSpaces(p, lineEnd), lineEnd);
+            }
+            p = lineEnd + 1;
+        }
+    }
+};
+
 class Mesh {
 public:
     std::vector<VEC3F> vertices;
@@ -39,62 +421,44 @@ public:
         return out;
     }
 
-    //readOBJ function adapted from http://www.opengl-tutorial.org
     void readOBJ(std::string filename) {
-        FILE * file = fopen(filename.c_str(), "r");
-        if (file == NULL){
-            printf("Could not open OBJ file %s for reading.\n", filename.c_str());
-            exit(1);
-        }
-        while (true){
-            char lineHeader[128];
-            // read the first word of the line
-            int res = fscanf(file, "%s", lineHeader);
-            if (res == EOF)
-                break;
-
-            if (strcmp(lineHeader, "v") == 0) {
-                VEC3F vertex;
-                fscanf(file, "%lf %lf %lf\n", &vertex.x(), &vertex.y(), &vertex.z());
-                vertices.push_back(vertex);
-            } else if (strcmp(lineHeader, "f") == 0){
-                size_t a_i, b_i, c_i;
-                int matches = fscanf(file, "%zd %zd %zd\n", &a_i, &b_i, &c_i);
-                if (matches != 3) {
-                    printf("Encountered malformed face data when reading OBJ %s. Make sure that UV and vertex normals are not included in the file.\n", filename.c_str());
-                    exit(1);
-                }
-
-                indices.push_back(a_i-1);
-                indices.push_back(b_i-1);
-                indices.push_back(c_i-1);
-            }
-        }
+        OBJReader<Real> obj(filename);
+        vertices.resize(obj.numVertices());
+        for (size_t i = 0; i < vertices.size(); i++)
+            vertices[i] = VEC3F(obj.positions[3 * i], obj.positions[3 * i + 1], obj.positions[3 * i + 2]);
+        indices = std::move(obj.indices);
 
         printf("Read %lu vertices and %lu faces from %s\n", vertices.size(), indices.size() / 3, filename.c_str());
     }
 
     void writeOBJ(std::string filename) {
-        std::ofstream out;
-        out.open(filename);
-        if (out.is_open() == false)
-            return;
-        out << "g " << "Obj" << std::endl;
-        for (size_t i = 0; i < vertices.size(); i++)
-            out << "v " << vertices.at(i).x() << " " << vertices.at(i).y() << " " << vertices.at(i).z() << '\n';
-        for (size_t i = 0; i < normals.size(); i++)
-            out << "vn " << normals.at(i).x() << " " << normals.at(i).y() << " " << normals.at(i).z() << '\n';
-        for (size_t i = 0; i < indices.size(); i += 3) {
-            out << "f " << indices.at(i) + 1 << "//" << indices.at(i) + 1
-                << " " << indices.at(i + 1) + 1 << "//" << indices.at(i + 1) + 1
-                << " " << indices.at(i + 2) + 1 << "//" << indices.at(i + 2) + 1
-                << '\n';
-        }
-        out.close();
+        OBJWriter out(filename, normals.size() == vertices.size());
+        write(out);
+        std::cout << "Wrote " << vertices.size() << " vertices and " << indices.size() / 3 << " faces to " << filename << std::endl;
+    }
 
+    void writePLY(std::string filename) {
+        PLYWriter out(filename, normals.size() == vertices.size());
+        write(out);
         std::cout << "Wrote " << vertices.size() << " vertices and " << indices.size() / 3 << " faces to " << filename << std::endl;
     }
 
+    // Writes binary PLY for *.ply filenames, OBJ otherwise
+    void write(std::string filename) {
+        if (isPLYFilename(filename)) writePLY(filename);
+        else writeOBJ(filename);
+    }
+
+    void write(MeshSink& out) {
+        out.addVertices(vertices.data(), normals.size() == vertices.size() ? normals.data() : NULL, vertices.size());
+        out.addTriangles(indices.data(), indices.size() / 3);
+        out.close();
+    }
+
+    static bool isPLYFilename(const std::string& filename) {
+        return filename.size() >= 4 && strcasecmp(filename.c_str() + filename.size() - 4, ".ply") == 0;
+    }
+
     Triangle triangle(int idx) {
         idx *= 3;
         Triangle out(&(vertices[indices[idx]]), &(vertices[indices[idx] + 1]), &(vertices[indices[idx] + 2]));